@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+namespace vpu::output {
+
+//Buffered output written out by a background thread, so the simulation never blocks on the
+//terminal or a pipe. Text is packed into fixed size chunks that are handed over through a
+//single producer, single consumer ring without locks. The ring is the whole memory budget.
+//When it is full the producer either waits for the writer or drops the chunk it was filling.
+//Only one thread may call write and flush.
+class AsyncWriter {
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+    struct Chunk {
+        std::unique_ptr<char[]> data;
+        size_t used = 0;
+    };
+    std::vector<Chunk> chunks;
+    //Chunks before head have been written out, chunks from head to tail are waiting. The producer
+    //fills the chunk at tail, which is always free.
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+    std::atomic<bool> closing{false};
+
+    int fd;
+    bool drop_when_full;
+    uint64_t dropped = 0;
+    std::thread thread;
+
+    void publish(bool may_drop);
+    void run();
+
+public:
+    AsyncWriter(int fd, size_t budget, bool drop_when_full);
+    //Writes out everything still buffered
+    ~AsyncWriter();
+    AsyncWriter(const AsyncWriter&) = delete;
+    AsyncWriter& operator=(const AsyncWriter&) = delete;
+
+    //Text from one call is never split unless it is larger than a chunk, so writing whole
+    //lines keeps dropped output to whole lines
+    void write(std::string_view text);
+    //Wait until everything written so far has reached the file
+    void flush();
+    uint64_t dropped_bytes() const { return dropped; }
+};
+
+}
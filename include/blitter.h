@@ -4,6 +4,9 @@
 
 #include "defs_pkg.h"
 #include "memory.h"
+#include "dma.h"
+#include "counters.h"
+#include "cycle_defer.h"
 
 namespace vpu {
 
@@ -24,6 +27,8 @@ public:
 
 private:
     std::unique_ptr<vpu::mem::Memory>& memory;
+    //Told of the range each command writes, so no bulk DMA row runs ahead of it
+    DMA& dma;
     enum {
         IDLE,
         WORKING,
@@ -36,14 +41,31 @@ private:
     std::function<void()> finished_callback;
     bool finished_callback_valid = false;
 
+    struct {
+        uint64_t busy_cycles = 0;
+        uint64_t idle_cycles = 0;
+        uint64_t bytes_moved = 0;
+    } counters;
+
+    void start(Command command);
     uint32_t next_address();
     void pixel_cycle();
     void clear_cycle();
+    uint32_t clear_finish_cycle() const;
 public:
     bool submit(Command command, std::function<void()> completion_callback);
-    Blitter(std::unique_ptr<vpu::mem::Memory>& memory);
+    //Run a command to completion immediately, for functional simulation
+    void execute(Command command);
+    Blitter(std::unique_ptr<vpu::mem::Memory>& memory, DMA& dma);
     void run_cycle();
-
+    //A busy pipe refuses new commands
+    bool busy() const { return state == WORKING; }
+    //The last cycle of a clear, now for any other command in progress or completing, NO_EVENT
+    //when idle
+    uint32_t next_event_cycle() const;
+    //Same as that many calls to run_cycle, up to but not including the next event
+    void skip_cycles(uint32_t cycles);
+    void register_counters(vpu::stats::Registry& registry);
 };
 
 }
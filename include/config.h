@@ -1,12 +1,22 @@
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
+#include <string>
 #include <variant>
+#include <vector>
+
+#include "memory.h"
 
 namespace fs = std::filesystem;
 
 namespace vpu::config {
 
+constexpr uint32_t MAX_DMA_CHANNELS = 16;
+constexpr uint32_t MAX_DMA_LATENCY = 1024;
+constexpr uint32_t MAX_DMA_READS = 64;
+constexpr uint32_t MAX_OUTPUT_BUFFER_MIB = 4096;
+
 struct Config {
     struct PosArg {
         std::string description = "";
@@ -17,6 +27,7 @@ struct Config {
         enum class ArgType {
             BOOLEAN,
             STRING,
+            STRING_LIST, //Repeatable, each use appends a value
             //...
         };
 
@@ -26,19 +37,49 @@ struct Config {
         uint count = 0;
         uint max_count = 1;
         ArgType type = ArgType::BOOLEAN;
-        std::variant<bool,std::string> value;
+        std::variant<bool,std::string,std::vector<std::string>> value;
         static OptArg OptBoolean(std::string l, std::string s, std::string d);
         static OptArg OptString(std::string l, std::string s, std::string d);
+        static OptArg OptStringList(std::string l, std::string s, std::string d);
+    };
+
+    struct MemRange {
+        uint32_t address;
+        uint32_t length;
     };
 
 
+    using MemoryBackend = vpu::mem::MemoryBackend;
+
+    enum class OutputPolicy {
+        BLOCK, //Wait for the output writer when its buffer is full
+        DROP   //Discard output when the buffer is full
+    };
+
     fs::path input_file;
     bool dump = false;
     bool pipeline = false;
     bool trace = false;
+    std::string trace_file = "";
+    uint64_t trace_ring = 1 << 20; //Records kept in trace_file
+    std::string pipeview = "";
+    size_t output_buffer = 16 << 20; //Bytes of --pipeline/--trace text buffered ahead of the terminal
+    OutputPolicy output_policy = OutputPolicy::BLOCK;
     bool step = false;
+    bool functional = false;
     std::string dump_regs = "";
     std::string dump_mem = "";
+    std::vector<MemRange> dump_mem_ranges;
+    bool dump_mem_digest = false;
+    bool dump_mem_compress = false;
+    bool stats = false;
+    std::string profile = "";
+    std::string profile_folded = "";
+    std::string stats_json = "";
+    MemoryBackend memory_backend = MemoryBackend::PAGED;
+    uint32_t dma_channels = 1; //Independent DMA command queues sharing the memory port
+    uint32_t dma_latency = 1;  //Cycles from a DMA read being issued to its data returning
+    uint32_t dma_reads = 1;    //DMA reads each channel can have in flight
 #ifdef RPC
     bool inspector = false;
 #endif
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace vpu::stats {
+
+//Counts of small integer samples such as queue occupancy, the last bucket also counts
+//everything above it
+struct Histogram {
+    std::vector<uint64_t> buckets;
+    explicit Histogram(size_t size) : buckets(size, 0) {}
+    void sample(size_t value, uint64_t count = 1) {
+        buckets[std::min(value, buckets.size() - 1)] += count;
+    }
+};
+
+//Modules keep their counters as plain members and update them directly, the registry only
+//holds references to them by name and reads them when the report is written.
+//Counters in the same group should be registered together.
+class Registry {
+    enum class Kind {
+        COUNTER,
+        RATIO,
+        HISTOGRAM
+    };
+    struct Entry {
+        Kind kind;
+        std::string group;
+        std::string name;
+        std::string description;
+        const uint64_t* value = nullptr;
+        const uint64_t* denominator = nullptr;
+        const Histogram* histogram = nullptr;
+    };
+    std::vector<Entry> entries;
+
+public:
+    void counter(std::string group, std::string name, const uint64_t& value, std::string description);
+    //Reported as value / denominator, 0 when the denominator is 0
+    void ratio(std::string group, std::string name, const uint64_t& value, const uint64_t& denominator, std::string description);
+    void histogram(std::string group, std::string name, const Histogram& histogram, std::string description);
+
+    void print_text(std::ostream& out) const;
+    void print_json(std::ostream& out) const;
+};
+
+}
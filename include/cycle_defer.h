@@ -1,9 +1,14 @@
+#pragma once
+#include <array>
 #include <assert.h>
 
 #include "defs_pkg.h"
 
 namespace vpu {
 
+//Returned by next_event_cycle when a component will not do anything until another one acts
+constexpr uint32_t NO_EVENT = 0xFFFFFFFF;
+
 template <typename T>
 struct Defer {
     uint32_t cycle;
@@ -18,8 +23,8 @@ struct Defer {
         assert(new_time > defs::get_global_cycle());
     }
 
-    void increment() {
-        cycle++;
+    void increment(uint32_t cycles = 1) {
+        cycle += cycles;
     }
 
     //Valid next cycle
@@ -33,4 +38,56 @@ struct Defer {
     }
 };
 
+//Fixed capacity FIFO of deferred values, each valid from the cycle after it was pushed.
+//Cycles are stored relative to a shared delay so the whole queue can be held back a
+//cycle, as on a stall, without touching its entries.
+template <typename T, size_t N>
+class DeferQueue {
+    struct Entry {
+        uint32_t cycle;
+        T data;
+    };
+    std::array<Entry,N> entries;
+    size_t head = 0;
+    size_t count = 0;
+    uint32_t delay = 0;
+
+public:
+    bool empty() const { return count == 0; }
+    size_t size() const { return count; }
+    bool full() const { return count == N; }
+
+    uint32_t front_cycle() const {
+        assert(count);
+        return entries[head].cycle + delay;
+    }
+    T& front() {
+        assert(count);
+        return entries[head].data;
+    }
+    bool can_run() const {
+        return count && front_cycle() == defs::get_global_cycle();
+    }
+
+    //Valid next cycle
+    void push_back(const T& data) {
+        assert(count < N);
+        size_t tail = head + count;
+        if (tail >= N) tail -= N;
+        entries[tail] = Entry{defs::get_next_global_cycle() - delay, data};
+        count++;
+    }
+    void pop_front() {
+        assert(count);
+        if (++head == N) head = 0;
+        //With nothing queued the delay can be dropped
+        if (--count == 0) delay = 0;
+    }
+
+    //Hold every queued entry back, one cycle by default
+    void stall(uint32_t cycles = 1) {
+        delay += cycles;
+    }
+};
+
 }
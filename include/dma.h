@@ -1,9 +1,14 @@
 #pragma once
+#include <array>
 #include <memory>
 #include <functional>
+#include <utility>
+#include <vector>
 
 #include "defs_pkg.h"
 #include "memory.h"
+#include "counters.h"
+#include "cycle_defer.h"
 
 namespace vpu {
 
@@ -14,6 +19,8 @@ public:
         COPY,
         SET
     };
+    //A copy with a length of zero instead walks a descriptor chain starting at its source.
+    //2D transfers move length bytes for each of height rows, stepping each row by the strides.
     struct Command
     {
         uint32_t dest;
@@ -21,35 +28,195 @@ public:
         uint32_t length;
         uint8_t value;
         Operation operation=DMA::NONE;
+        uint32_t height = 1;
+        uint32_t source_stride = 0;
+        uint32_t dest_stride = 0;
     };
+    //Chain descriptors are little endian words at a DESCRIPTOR_ALIGN aligned address:
+    //  source, dest, length, control, next, height, source stride, dest stride
+    //control holds the Operation in bits 0-7 and the SET value in bits 8-15. A height of zero
+    //or one is a plain transfer. A next of zero ends the chain. Each descriptor takes a cycle
+    //to read, then its transfer runs as if it had been submitted on its own. The whole chain
+    //completes as one command. A descriptor that is misaligned, past the end of memory or has
+    //an invalid operation, a transfer outside memory and a chain that loops are fatal errors.
+    static constexpr uint32_t DESCRIPTOR_ALIGN = 32;
+    //Most reads a channel can have in flight
+    static constexpr uint32_t MAX_READS = 64;
 private:
-    std::unique_ptr<vpu::mem::Memory>& memory;
-    enum {
-        IDLE,
-        WORKING,
-        FINISHED
-    } state = IDLE;
-    uint32_t work_cycle;
-    Command working_command;
-    std::function<void()> working_callback;
-    std::function<void()> finished_callback;
-    bool finished_callback_valid = false;
-    uint32_t write_pointer;
-    uint32_t read_pointer;
-    bool fetched_writeback_data_valid = false;
-    std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> fetched_writeback_data;
-
-    bool active_buffer_valid = false;
-    uint32_t active_buffer_address = 0;
-    uint32_t active_buffer_size = 0;
-    std::array<uint8_t,2*vpu::defs::MEM_ACCESS_WIDTH> active_buffer;
-
-    void copy_cycle();
-    void set_cycle();
+    //Moves one command at a time and completes it on its own, using the memory port only on
+    //the cycles the arbiter grants it
+    class Channel {
+        //What the current row needs from the memory port next
+        enum Access {
+            NO_ACCESS, //Waiting for read data to return
+            READ,
+            EDGE_FETCH,
+            WRITE
+        };
+        struct Read {
+            uint32_t ready_cycle;
+            uint32_t bytes;
+        };
+        //Timing state of the current row, kept apart from the data so a bulk row can be run ahead
+        struct Progress {
+            uint32_t read_pointer;
+            uint32_t write_pointer;
+            //Reads in flight, oldest first, in a ring of max_reads entries
+            std::array<Read,MAX_READS> reads;
+            uint32_t reads_head = 0;
+            uint32_t reads_count = 0;
+            uint32_t in_flight_bytes = 0;
+            //Bytes returned by reads and not yet written
+            uint32_t buffered = 0;
+            //Edge line has been fetched for a partial write, usable from edge_ready_cycle
+            bool edge_fetched = false;
+            uint32_t edge_ready_cycle = 0;
+        };
+
+        DMA& dma;
+        std::unique_ptr<vpu::mem::Memory>& memory;
+        //Cycles from a read being issued until its data can be written, and how many reads
+        //may be in flight. A latency of one with one read is the lockstep read then write.
+        uint32_t read_latency;
+        uint32_t max_reads;
+        uint32_t work_cycle;
+        Command working_command;
+        std::function<void()> working_callback;
+        std::function<void()> finished_callback;
+        bool finished_callback_valid = false;
+        Progress progress;
+        //Rows of the current transfer still to finish, each is moved like a transfer of its own
+        uint32_t rows_left = 0;
+        //Chain descriptor to read on the next work cycle, and the one after the current transfer
+        bool descriptor_pending = false;
+        uint32_t next_descriptor = 0;
+        //Descriptors read in the current chain, and the address of the last one read at a power
+        //of two. A chain that loops comes back to the mark once its loop fits in the gap.
+        uint64_t chain_length = 0;
+        uint32_t chain_mark = 0;
+
+        //Source bytes of the reads in flight and buffered, oldest first from line_head in a
+        //ring. Reads stop once max_reads lines are held, so it needs room for one more.
+        std::vector<uint8_t> line_buffer;
+        uint32_t line_head = 0;
+
+        //Rows are moved in one go on their last write unless intermediate memory states are
+        //wanted. The line by line model times the bulk path exactly, and anything reaching a bulk
+        //row first has it moved as far as it would have got and finished line by line.
+        bool line_accurate;
+        bool bulk = false;
+        //Cycle of the last write of a bulk row when every access is granted, worked out by
+        //running the timing ahead and kept until the channel waits for the port. The run ahead
+        //also keeps the state going into that cycle, so skipping up to it needs no stepping.
+        mutable bool finish_valid = false;
+        mutable uint32_t finish_cycle;
+        mutable Progress finish_progress;
+        mutable uint64_t finish_read_wait_cycles;
+        //Whether the run ahead made an access before the last write, and the cycle of the last one
+        mutable bool finish_accessed;
+        mutable uint32_t finish_last_access;
+        bool can_bulk(const Command& command) const;
+        uint32_t bulk_finish_cycle() const;
+        void bulk_transfer();
+
+        void start(Command command);
+        void start_transfer(Command command);
+        void start_row();
+        void fetch_descriptor();
+        bool command_done();
+        //Bytes of the line at address within the source or destination range
+        std::pair<uint32_t,uint32_t> source_range(uint32_t address) const;
+        std::pair<uint32_t,uint32_t> dest_range(uint32_t address) const;
+        Access next_access(Progress& progress, uint32_t cycle) const;
+        //Timing side of an access, access also moves the data
+        void advance(Progress& progress, Access access, uint32_t cycle) const;
+        bool row_done(const Progress& progress) const;
+        void access(Access access, uint32_t cycle);
+    public:
+        enum {
+            IDLE,
+            WORKING,
+            FINISHED
+        } state = IDLE;
+        struct {
+            uint64_t busy_cycles = 0;
+            uint64_t wait_cycles = 0;
+            uint64_t read_wait_cycles = 0;
+            uint64_t bytes_moved = 0;
+            uint64_t descriptors = 0;
+        } counters;
+
+        Channel(DMA& dma, std::unique_ptr<vpu::mem::Memory>& memory, bool line_accurate, uint32_t read_latency, uint32_t max_reads);
+        bool submit(Command command, std::function<void()> completion_callback);
+        void execute(Command command);
+        //Completion and bookkeeping at the start of a cycle, false when idle
+        bool begin_cycle();
+        //Whether the channel has an access for the memory port this cycle, called once a cycle
+        bool request_port();
+        //Work done on a cycle the memory port is granted
+        void port_cycle();
+        void port_denied();
+        bool active() const { return state != IDLE || finished_callback_valid; }
+        //Whether an access to the range would see memory the bulk row has yet to move. A read
+        //only conflicts with the destination, a write with the source as well.
+        bool bulk_overlaps(uint32_t address, uint32_t length, bool write) const {
+            if (state != WORKING || !bulk || descriptor_pending) return false;
+            auto overlaps = [&](uint64_t start) {
+                return address < start + working_command.length && start < (uint64_t)address + length;
+            };
+            return overlaps(working_command.dest) || (write && working_command.operation == COPY && overlaps(working_command.source));
+        }
+        void leave_bulk();
+        uint32_t next_event_cycle() const;
+        //Returns whether the skipped cycles used the memory port
+        bool skip_cycles(uint32_t cycles);
+    };
+
+    std::vector<Channel> channels;
+    //Channel checked first for the memory port, the one after the last granted
+    uint32_t next_grant = 0;
+    //Range another component is writing over the coming cycles, rows overlapping it are not bulk
+    uint32_t claim_address = 0;
+    uint32_t claim_length = 0;
+    bool claimed(uint32_t address, uint32_t length) const {
+        return address < (uint64_t)claim_address + claim_length && claim_address < (uint64_t)address + length;
+    }
+
+    struct {
+        uint64_t busy_cycles = 0;
+        uint64_t idle_cycles = 0;
+        //Summed over the channels when registered
+        uint64_t read_wait_cycles = 0;
+        uint64_t bytes_moved = 0;
+        uint64_t descriptors = 0;
+    } counters;
 public:
-    bool submit(Command command, std::function<void()> completion_callback);
-    DMA(std::unique_ptr<vpu::mem::Memory>& memory);
+    //Channels take commands independently and share one memory port, granted a cycle at a
+    //time round robin between the channels with an access ready
+    DMA(std::unique_ptr<vpu::mem::Memory>& memory, bool line_accurate = false, uint32_t channel_count = 1,
+        uint32_t read_latency = 1, uint32_t max_reads = 1);
+    uint32_t channel_count() const { return channels.size(); }
+    bool submit(uint32_t channel, Command command, std::function<void()> completion_callback);
+    //Run a command to completion immediately, for functional simulation
+    void execute(Command command);
     void run_cycle();
+    //A busy channel refuses new commands
+    bool busy(uint32_t channel) const { return channels[channel].state == Channel::WORKING; }
+    //The last cycle of a bulk command when it is the only one, now while any other command is
+    //in progress or completing, NO_EVENT when idle
+    uint32_t next_event_cycle() const;
+    //Same as that many calls to run_cycle while there is no event
+    void skip_cycles(uint32_t cycles);
+    void register_counters(vpu::stats::Registry& registry);
+    //Called before anything else accesses memory, so bulk rows the range overlaps first move
+    //what the line by line model would have moved by now
+    void sync(uint32_t address, uint32_t length, bool write) {
+        for (auto& channel : channels)
+            if (channel.bulk_overlaps(address, length, write)) channel.leave_bulk();
+    }
+    //For writes spread over cycles, such as a blitter clear, that a bulk row cannot be run ahead
+    //of. A length of zero ends the claim.
+    void claim_writes(uint32_t address, uint32_t length);
 };
 
 }
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+namespace vpu::dump {
+
+//Sparse memory dump, all fields little endian:
+//  header: magic "VPUZ", uint32 version, uint32 page size, uint32 page count, uint64 memory size
+//  then one record per stored page in increasing index order:
+//          uint32 page index, uint32 flags, uint32 data length, data
+//Pages missing from the dump are all zero. Page data is LZ compressed unless flagged raw.
+constexpr std::array<char,4> SPARSE_MAGIC = {'V','P','U','Z'};
+constexpr uint32_t SPARSE_VERSION = 1;
+constexpr uint32_t PAGE_RAW = 0x1;
+
+struct SparseHeader {
+    std::array<char,4> magic;
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t page_count;
+    uint64_t mem_size;
+};
+
+struct PageHeader {
+    uint32_t index;
+    uint32_t flags;
+    uint32_t length;
+};
+
+static_assert(sizeof(SparseHeader) == 24 && sizeof(PageHeader) == 12, "Dump headers must be packed");
+
+bool all_zero(std::span<const uint8_t> data);
+
+//Append the page record for data to out, leaves out unchanged for all zero pages
+void encode_page(uint32_t index, std::span<const uint8_t> data, std::vector<uint8_t>& out);
+
+//LZ codec. Each token starts with a control byte:
+//  0b0nnnnnnn: n+1 literal bytes follow
+//  0b1nnnnnnn: copy n+4 bytes from a 16-bit little endian distance back in the output
+void compress(std::span<const uint8_t> in, std::vector<uint8_t>& out);
+//Returns false if the input is malformed or does not exactly fill out
+bool decompress(std::span<const uint8_t> in, std::span<uint8_t> out);
+
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <array>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.h"
+#include "defs_pkg.h"
+#include "dma.h"
+#include "blitter.h"
+#include "counters.h"
+
+namespace vpu {
+
+//Instruction at a time interpreter for the management core. Produces the same architectural
+//register and memory state as ManagerCore without modelling timing, DMA and blitter commands
+//complete as soon as they are issued.
+class FunctionalCore {
+    std::array<uint32_t,vpu::defs::REGISTER_COUNT> registers;
+    std::array<bool,vpu::defs::FLAG_COUNT> flags;
+    std::unique_ptr<vpu::mem::Memory>& memory;
+    DMA& dma;
+    Blitter& blitter;
+
+    //Command state built up by the pipe instructions, as in the scheduler frontends
+    DMA::Command dma_frontend_state{};
+    Blitter::Command blitter_frontend_state{};
+
+    //Straight line code is translated into blocks of pre-bound handlers, ending at the first
+    //JMP_L, BRA_L or HLT. A compare directly before a branch is fused into one handler.
+    //Blocks are cached by start PC and link directly to their successors once those have
+    //been looked up. Writing to a page drops every block that covers it.
+    enum class Handler : uint8_t {
+        NOP, HLT, SEGMENT_END, INVALID, FALLTHROUGH,
+        JMP_L, BRA_L, CMP_R_BRA_L, CMP_R_R_BRA_L,
+        MOV_I24, ADD_I24, ASR_I24, LSR_I24, LSL_I24, ASR_R, LSR_R, LSL_R,
+        CMP_R, CMP_R_R, MOV_R_I16, MOV_R_R,
+        DMA_DST_R, DMA_SRC_R, DMA_LEN_R, DMA_SET_R, DMA_CPY,
+        BLI_COL_R, BLI_PIX_R_R, BLI_CLR,
+        COUNT
+    };
+    std::array<const void*,(size_t)Handler::COUNT> handlers;
+
+    struct Op {
+        const void* handler;
+        uint32_t operand;
+        uint8_t reg0;
+        uint8_t reg1;
+    };
+    struct Block {
+        uint32_t start;
+        uint32_t end;    //Address of the last instruction
+        uint32_t length; //Instructions, counting both halves of a fused pair
+        std::vector<Op> ops;
+        Block* taken = nullptr;
+        Block* fallthrough = nullptr;
+    };
+    //Blocks also end before crossing this many instructions, so translation stays bounded
+    static constexpr uint32_t MAX_BLOCK_LENGTH = 256;
+    std::unordered_map<uint32_t,std::unique_ptr<Block>> blocks;
+    std::unordered_map<uint32_t,std::vector<uint32_t>> page_blocks;
+    //Blocks dropped by a write during execution, kept alive until the running block exits
+    std::vector<std::unique_ptr<Block>> stale_blocks;
+    bool blocks_invalidated = false;
+    Block* find_block(uint32_t pc);
+    Block* translate(uint32_t pc);
+    Op translate_instruction(uint32_t instruction);
+    void invalidate_page(uint32_t page);
+
+    uint64_t retired = 0;
+
+public:
+    FunctionalCore(
+        std::unique_ptr<vpu::mem::Memory>& memory,
+        DMA& dma,
+        Blitter& blitter
+    );
+    //Run from the current PC until HLT
+    void run();
+    uint32_t get_register(vpu::defs::Register reg);
+    uint64_t retired_instructions();
+    void register_counters(vpu::stats::Registry& registry);
+};
+
+}
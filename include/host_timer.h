@@ -0,0 +1,63 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+//Host time spent in each component, for finding where the simulator itself is slow.
+//Only built with the HOST_TIMERS CMake option, otherwise HOST_TIMER compiles to nothing.
+namespace vpu::host_timer {
+
+enum Section : uint8_t {
+    CORE,
+    FETCH,
+    DECODE,
+    EXECUTE,
+    MEMORY,
+    WRITEBACK,
+    SCHEDULER,
+    DMA,
+    BLITTER,
+    SECTION_COUNT
+};
+
+inline std::array<uint64_t,SECTION_COUNT> ticks{};
+
+//TSC where available, converted to ns when reported
+inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+class Scope {
+    Section section;
+    uint64_t start;
+public:
+    explicit Scope(Section section) : section(section), start(now()) {}
+    ~Scope() { ticks[section] += now() - start; }
+};
+
+//Call once before simulating, so ticks can be calibrated against wall time
+void start();
+//ns per simulated cycle for each section
+void report(std::ostream& out, uint64_t cycles);
+
+}
+
+#ifdef HOST_TIMERS
+#define HOST_TIMER_CONCAT(a, b) a##b
+#define HOST_TIMER_NAME(line) HOST_TIMER_CONCAT(host_timer_scope_, line)
+#define HOST_TIMER(section) vpu::host_timer::Scope HOST_TIMER_NAME(__LINE__)(vpu::host_timer::section)
+#else
+#define HOST_TIMER(section) do {} while (0)
+#endif
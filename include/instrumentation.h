@@ -0,0 +1,27 @@
+#pragma once
+
+#include "config.h"
+
+namespace vpu::instrument {
+
+//Compile time instrumentation policies. The simulation core is instantiated once per policy
+//and one is picked from the config at startup, so hooks a policy leaves out cost nothing.
+
+//Production runs, no per cycle status or profiling hooks
+struct Headless {
+    static constexpr bool STATUS = false;
+    static constexpr bool PROFILE = false;
+};
+
+//Pipeline and trace printing, binary trace files, stepping, guest profiling
+struct Instrumented {
+    static constexpr bool STATUS = true;
+    static constexpr bool PROFILE = true;
+};
+
+inline bool wants_instrumentation(const config::Config& config) {
+    return config.pipeline || config.trace || config.trace_file != "" || config.pipeview != "" || config.step
+        || config.profile != "" || config.profile_folded != "";
+}
+
+}
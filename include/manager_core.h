@@ -1,23 +1,33 @@
 #pragma once
 #include <array>
 #include <memory>
-#include <deque>
 #include <tuple>
 
 #include "config.h"
 #include "memory.h"
 #include "defs_pkg.h"
 #include "scheduler.h"
+#include "cycle_defer.h"
+#include "instrumentation.h"
+#include "trace.h"
+#include "async_writer.h"
+#include "counters.h"
+#include "profiler.h"
+#include "pipeview.h"
 
 namespace vpu {
 
+template <typename Policy>
 class ManagerCore;
 class ManagerCoreSnooper {
 public:
     ManagerCoreSnooper() = delete;
-    static uint32_t get_register(ManagerCore& core, vpu::defs::Register reg);
+    template <typename Policy>
+    static uint32_t get_register(ManagerCore<Policy>& core, vpu::defs::Register reg);
 };
 
+//Policy is one of vpu::instrument, hooks it disables are compiled out
+template <typename Policy>
 class ManagerCore {
     friend ManagerCoreSnooper;
     std::array<uint32_t,vpu::defs::REGISTER_COUNT> registers;
@@ -37,25 +47,42 @@ class ManagerCore {
     uint32_t PC();
 
     Scheduler& scheduler;
+    //Fetch reads code a DMA transfer may still be moving
+    DMA& dma;
 
     /* Stages */
+    //Inter-stage queues never hold more entries than there are stages
+    static constexpr size_t PIPELINE_DEPTH = 5;
+
     //Instruction Fetch
     void stage_fetch(bool frontend_stall, bool flush_valid, uint32_t flush_addr);
     bool fetch_seen_hlt = false;
     
+    //seq numbers instructions for --pipeview, zero otherwise
     struct DecodeInput {
         uint32_t instruction;
         uint32_t pc;
         uint32_t next_pc;
+        uint64_t seq;
     };
     
+    //Where execute takes an operand value from
+    enum class OperandKind : uint8_t {
+        NONE,      //Unused, reads as zero
+        IMMEDIATE, //Value decoded from the instruction
+        REGISTER   //Register index, read with forwarding
+    };
+
     struct ExecuteInput {
         vpu::defs::Opcode opcode;
         vpu::defs::Register dest;
         uint32_t source0;
         uint32_t source1;
+        OperandKind source0_kind;
+        OperandKind source1_kind;
         uint32_t pc;
         uint32_t next_pc;
+        uint64_t seq;
     };
 
     struct MemoryInput {
@@ -63,6 +90,7 @@ class ManagerCore {
         bool write;
         vpu::defs::Register dest;
         uint32_t value;
+        uint64_t seq;
         //TODO flags
     };
 
@@ -71,14 +99,32 @@ class ManagerCore {
         bool write;
         vpu::defs::Register dest;
         uint32_t value;
+        uint64_t seq;
         //TODO flags
     };
 
     //Instruction Decode
     //cycle,instruction,pc,nextpc
-    std::deque<Defer<DecodeInput>> decode_input_queue;
+    DeferQueue<DecodeInput,PIPELINE_DEPTH> decode_input_queue;
     void stage_decode(bool frontend_stall);
 
+    //Decoded instruction cache, direct mapped on PC. An entry is only used when the fetched
+    //instruction word matches, so code written since it was decoded is decoded again.
+    struct DecodedInstruction {
+        bool valid = false;
+        uint32_t pc;
+        uint32_t instruction;
+        vpu::defs::Opcode opcode;
+        vpu::defs::Register dest;
+        uint32_t source0;
+        uint32_t source1;
+        OperandKind source0_kind;
+        OperandKind source1_kind;
+    };
+    static constexpr uint32_t DECODE_CACHE_SIZE = 1024;
+    std::array<DecodedInstruction,DECODE_CACHE_SIZE> decode_cache;
+    DecodedInstruction decode_instruction(uint32_t instruction, uint32_t pc);
+
     //probably only 2 entries ever needed, but all keeps it simpler for now
     //TODO: this will be cleared when the same entry reaches writeback commit 
     //      with same value, may need a smarter system
@@ -88,42 +134,95 @@ class ManagerCore {
 
     //Execution
     //cycle,opcode,dest,source0,source1,nextpc
-    std::deque<Defer<ExecuteInput>> execute_input_queue;
+    DeferQueue<ExecuteInput,PIPELINE_DEPTH> execute_input_queue;
     void stage_execute();
-    std::deque<Defer<uint32_t>> flush_queue;
+    uint32_t operand_value(OperandKind kind, uint32_t operand);
+    DeferQueue<uint32_t,PIPELINE_DEPTH> flush_queue;
 
     //Memory Access
-    std::deque<Defer<MemoryInput>> memory_input_queue;
+    DeferQueue<MemoryInput,PIPELINE_DEPTH> memory_input_queue;
     void stage_memory();
 
     //Writeback
     //Memory Access
-    std::deque<Defer<WritebackInput>> writeback_input_queue;
+    DeferQueue<WritebackInput,PIPELINE_DEPTH> writeback_input_queue;
     void stage_writeback();
-    bool writeback_valid = false;
-    vpu::defs::Opcode writeback_opcode;
     /* End stages */    
 
+    struct {
+        uint64_t cycles = 0;
+        uint64_t retired_instructions = 0;
+        uint64_t scheduler_stall_cycles = 0;
+        uint64_t flushes = 0;
+        uint64_t bht_hits = 0;
+        uint64_t bht_misses = 0;
+        uint64_t btb_hits = 0;
+        uint64_t btb_misses = 0;
+    } counters;
+
+    //Profiling, the instruction in execute and what it did this cycle
+    std::unique_ptr<vpu::profile::Profiler> profiler;
+    bool profile_sampled = false;
+    uint32_t profile_pc = 0;
+    vpu::profile::Cause profile_cause;
+    bool profile_refilling = false;
+    uint32_t profile_flush_pc = 0;
+    void profile_execute(uint32_t pc, vpu::profile::Cause cause) {
+        if constexpr (Policy::PROFILE) {
+            profile_sampled = true;
+            profile_pc = pc;
+            profile_cause = cause;
+            //Set again straight after if this instruction is a mispredicted branch
+            if (cause == vpu::profile::EXECUTING) profile_refilling = false;
+        }
+    }
+    void profile_cycle();
+
     //Status printing
-    std::string status_fetch_opcode;
-    std::string status_decode_opcode;
-    std::string status_execute_opcode;
-    std::string status_memory_opcode;
-    std::string status_writeback_opcode;
-    std::string pipeline_string();
-    std::string pipeline_heading();
-    std::string trace_string();
+    //Opcode held by each stage this cycle, only formatted when output is requested
+    enum Stage : uint8_t {FETCH, DECODE, EXECUTE, MEMORY, WRITEBACK};
+    vpu::trace::PipelineStatus stage_status{};
+    void record_stage(Stage stage, vpu::defs::Opcode opcode) {
+        if constexpr (Policy::STATUS)
+            stage_status[stage] = vpu::trace::StageStatus{true, opcode};
+    }
+    //Only opened for --trace_file
+    std::unique_ptr<vpu::trace::TraceWriter> trace_writer;
+    //Only created for --pipeline or --trace
+    std::unique_ptr<vpu::output::AsyncWriter> status_output;
+    //Only opened for --pipeview
+    std::unique_ptr<vpu::trace::PipeView> pipeview;
+    void pipeview_stage(uint64_t seq, vpu::trace::PipeView::Stage stage) {
+        if constexpr (Policy::STATUS)
+            if (pipeview) pipeview->stage(seq, stage);
+    }
 
 public:
     ManagerCore(
         vpu::config::Config& config,
         std::unique_ptr<vpu::mem::Memory>& memory,
-        Scheduler& scheduler
+        Scheduler& scheduler,
+        DMA& dma
     );
     void run_cycle();
+    //Now unless the core is stalled on a pipe instruction the scheduler would refuse again,
+    //then NO_EVENT as only the scheduler or a pipe can end the stall
+    uint32_t next_event_cycle();
+    //Same as that many stalled calls to run_cycle, only without instrumentation
+    void skip_cycles(uint32_t cycles);
     bool check_has_halted();
     void print_status_start();
     void print_status(uint32_t cycle=0);
+    //Wait for printed status to reach stdout
+    void flush_status();
+    void register_counters(vpu::stats::Registry& registry);
+    //Only created for --profile or --profile_folded
+    const vpu::profile::Profiler* get_profiler() { return profiler.get(); }
 };
 
-}
\ No newline at end of file
+template <typename Policy>
+uint32_t ManagerCoreSnooper::get_register(ManagerCore<Policy>& core, vpu::defs::Register reg) {
+    return core.registers[reg];
+}
+
+}
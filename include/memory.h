@@ -1,15 +1,59 @@
 #pragma once
 
+#include <assert.h>
 #include <memory>
 #include <cstdint>
 #include <array>
+#include <bit>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <filesystem>
+#include <functional>
+#include <span>
+#include <vector>
 
 #include "defs_pkg.h"
 
 namespace vpu::mem {
+
+//Backing store is split into fixed size pages, only allocated on first write
+constexpr uint32_t PAGE_BITS = 16;
+constexpr uint32_t PAGE_SIZE = 1 << PAGE_BITS;
+constexpr uint32_t PAGE_MASK = PAGE_SIZE - 1;
+constexpr uint32_t PAGE_COUNT = (vpu::defs::MEM_SIZE + PAGE_SIZE - 1) >> PAGE_BITS;
+static_assert(PAGE_SIZE % vpu::defs::MEM_ACCESS_WIDTH == 0, "Memory accesses must not cross a page");
+
+//Where the backing store comes from, chosen with --memory
+enum class MemoryBackend {
+    PAGED,        //Pages allocated on first write
+    DENSE,        //Single mapping of the whole memory, normal pages
+    DENSE_THP,    //Single mapping, transparent hugepages requested with madvise
+    DENSE_HUGETLB //Single mapping, explicit MAP_HUGETLB hugepages
+};
+
+//Sectioned program container, files without the magic are loaded as a flat image at address 0.
+//All fields are little endian:
+//  header:  magic "VPUS", uint32 segment count
+//  segment: uint32 load address, uint32 length, uint32 file offset, uint32 flags
+//Zero fill segments store no bytes and their file offset is ignored.
+constexpr std::array<char,4> SECTIONED_MAGIC = {'V','P','U','S'};
+constexpr uint32_t SEGMENT_ZERO_FILL = 0x1;
+
+struct SectionedHeader {
+    std::array<char,4> magic;
+    uint32_t segment_count;
+};
+
+struct SegmentHeader {
+    uint32_t address;
+    uint32_t length;
+    uint32_t file_offset;
+    uint32_t flags;
+};
+
+static_assert(sizeof(SectionedHeader) == 8 && sizeof(SegmentHeader) == 16, "Container headers must be packed");
+
 class Memory;
 
 class MemorySnooper {
@@ -17,18 +61,97 @@ public:
     MemorySnooper() = delete;
     static void copy_file_in(std::unique_ptr<Memory>& memory, std::filesystem::path file);
     static uint8_t get_byte(std::unique_ptr<Memory>& memory, uint32_t index);
-    static std::array<uint8_t,vpu::defs::MEM_SIZE>& get_data(std::unique_ptr<Memory>& memory);
+    //Copy out.size() bytes starting at addr
+    static void get_data(std::unique_ptr<Memory>& memory, uint32_t addr, std::span<uint8_t> out);
+    //Contents of a page, pages never written read as zero
+    static std::span<const uint8_t,PAGE_SIZE> get_page(std::unique_ptr<Memory>& memory, uint32_t page);
+    static bool page_allocated(std::unique_ptr<Memory>& memory, uint32_t page);
 };
 
 class Memory {
     friend MemorySnooper;
-    std::array<uint8_t,vpu::defs::MEM_SIZE> data;
+    //Unwritten pages all point at a shared zero page for reading and have no write page.
+    //Watched pages also have no write page, so the first write to them takes the slow path.
+    std::array<const uint8_t*,PAGE_COUNT> read_pages;
+    std::array<uint8_t*,PAGE_COUNT> write_pages;
+    std::array<uint8_t*,PAGE_COUNT> page_data; //nullptr until allocated
+    std::vector<std::unique_ptr<uint8_t[]>> page_storage;
+
+    std::array<bool,PAGE_COUNT> watched_pages;
+    std::vector<std::function<void(uint32_t)>> write_watchers;
+
+    //Dense backends map the whole memory in one go and point every page into it
+    uint8_t* dense_mapping = nullptr;
+    size_t dense_mapping_size = 0;
+    void map_dense(MemoryBackend backend);
+
+    //Program files mapped copy-on-write as the initial contents of whole pages
+    std::vector<std::pair<void*,size_t>> file_mappings;
+    void load_file(int fd, size_t file_offset, uint32_t addr, size_t length);
+    void zero_fill(uint32_t addr, size_t length);
+
+    uint8_t* allocate_page(uint32_t page);
+    uint8_t* write_page_slow(uint32_t page);
+    uint8_t* get_write_page(uint32_t addr) {
+        uint8_t* page = write_pages[addr >> PAGE_BITS];
+        return page ? page : write_page_slow(addr >> PAGE_BITS);
+    }
+    void write_bytes(uint32_t addr, const uint8_t* src, size_t length);
 public:
-    Memory();
+    Memory(MemoryBackend backend = MemoryBackend::PAGED);
+    ~Memory();
     uint32_t read_word(uint32_t addr);
     void write_word(uint32_t addr, uint32_t data);
     std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> read(uint32_t addr);
     void write(uint32_t addr, std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> data);
+
+    //Watchers are called with the page index before the first write to a watched page,
+    //after which the page is no longer watched. Used to invalidate state derived from memory.
+    void add_write_watcher(std::function<void(uint32_t)> watcher);
+    void watch_page(uint32_t page);
+
+    //Bulk transfers for pipes that model their timing separately, the ranges must not overlap
+    void copy(uint32_t dest, uint32_t source, size_t length);
+    void fill(uint32_t dest, uint8_t value, size_t length);
+
+    //Views of a 64-byte aligned line in place, lines never cross a page.
+    //A read view of a page that has not been written does not see later writes, so views
+    //should only be held for the current access.
+    std::span<const uint8_t,vpu::defs::MEM_ACCESS_WIDTH> read_line(uint32_t addr) {
+        assert((addr & (vpu::defs::MEM_ACCESS_WIDTH-1)) == 0);
+        assert(addr <= vpu::defs::MEM_SIZE-vpu::defs::MEM_ACCESS_WIDTH);
+        return std::span<const uint8_t,vpu::defs::MEM_ACCESS_WIDTH>(read_pages[addr >> PAGE_BITS] + (addr & PAGE_MASK), vpu::defs::MEM_ACCESS_WIDTH);
+    }
+    std::span<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> write_line(uint32_t addr) {
+        assert((addr & (vpu::defs::MEM_ACCESS_WIDTH-1)) == 0);
+        assert(addr <= vpu::defs::MEM_SIZE-vpu::defs::MEM_ACCESS_WIDTH);
+        return std::span<uint8_t,vpu::defs::MEM_ACCESS_WIDTH>(get_write_page(addr) + (addr & PAGE_MASK), vpu::defs::MEM_ACCESS_WIDTH);
+    }
 };
 
-}
\ No newline at end of file
+//Words are little endian in memory, so native loads and stores work directly on little endian hosts
+inline uint32_t Memory::read_word(uint32_t addr) {
+    addr &= 0xFFFFFFFC;
+    const uint8_t* src = read_pages[addr >> PAGE_BITS] + (addr & PAGE_MASK);
+    uint32_t ret = 0;
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(&ret, src, 4);
+    } else {
+        for (size_t i = 0; i<4; i++)
+            ret |= src[i] << (i*8);
+    }
+    return ret;
+}
+
+inline void Memory::write_word(uint32_t addr, uint32_t data) {
+    addr &= 0xFFFFFFFC;
+    uint8_t* dst = get_write_page(addr) + (addr & PAGE_MASK);
+    if constexpr (std::endian::native == std::endian::little) {
+        std::memcpy(dst, &data, 4);
+    } else {
+        for (size_t i = 0; i<4; i++)
+            dst[i] = 0xFF & (data >> 8*i);
+    }
+}
+
+}
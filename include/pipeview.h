@@ -0,0 +1,61 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "defs_pkg.h"
+#include "async_writer.h"
+
+namespace vpu::trace {
+
+//Streams each instruction's path through the pipeline in the Kanata log format read by the
+//Konata pipeline viewer. Every fetched instruction gets a sequence number, a stage is only
+//logged when an instruction enters it, so stalls show as long stages. Instructions either
+//retire after writeback or are flushed, wrong path instructions are drawn as flushed.
+class PipeView {
+public:
+    enum Stage : uint8_t {NONE, FETCH, DECODE, EXECUTE, EXECUTE_STALL, MEMORY, WRITEBACK};
+
+private:
+    int fd = -1;
+    std::unique_ptr<vpu::output::AsyncWriter> output;
+    std::string line;
+    uint64_t cycle = 0;
+    uint64_t next_seq = 0;
+    uint64_t retired = 0;
+
+    //An instruction held in fetch by a stall keeps its number until it is passed on
+    bool fetch_pending = false;
+    uint64_t fetch_seq = 0;
+    uint32_t fetch_pc = 0;
+
+    //Stage each in flight instruction was last logged in, NONE once it has ended. There are
+    //far more slots than instructions can be in flight.
+    static constexpr size_t WINDOW = 16;
+    std::array<Stage,WINDOW> stages{};
+    //Writeback is drawn for a cycle before the instruction retires
+    std::vector<uint64_t> retiring;
+
+    void end(uint64_t seq, bool flushed);
+
+public:
+    PipeView(const std::string& path, size_t budget);
+    ~PipeView();
+    PipeView(const PipeView&) = delete;
+    PipeView& operator=(const PipeView&) = delete;
+
+    //Start of each simulated cycle
+    void start_cycle(uint64_t cycle);
+    //Sequence number of the instruction fetched at pc, the same one again while fetch is stalled
+    uint64_t fetch(uint32_t pc, vpu::defs::Opcode opcode);
+    //The fetched instruction was passed to decode
+    void fetched() { fetch_pending = false; }
+    void stage(uint64_t seq, Stage stage);
+    void retire(uint64_t seq) { retiring.push_back(seq); }
+    void flush(uint64_t seq) { end(seq, true); }
+};
+
+}
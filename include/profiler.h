@@ -0,0 +1,38 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+#include <span>
+#include <string>
+#include <unordered_map>
+
+namespace vpu::profile {
+
+//What the instruction holding up retirement was doing in a cycle
+enum Cause : uint8_t {
+    EXECUTING,       //Progressed through execute
+    SCHEDULER_STALL, //Pipe instruction refused by a full scheduler queue
+    FENCE_WAIT,      //P_SCH_FNC waiting for outstanding pipe work
+    FLUSH_REFILL,    //Pipeline refilling after this branch mispredicted
+    PIPELINE_FILL,   //Nothing in execute outside of a flush, at start up and around halting
+    CAUSE_COUNT
+};
+
+//Cycles attributed to each guest PC, split by cause
+class Profiler {
+    std::unordered_map<uint32_t,std::array<uint64_t,CAUSE_COUNT>> samples;
+
+public:
+    void sample(uint32_t pc, Cause cause) {
+        samples[pc][cause]++;
+    }
+
+    //program is the image from address 0 up to its end marker, used to name PCs with their
+    //opcode and the label (branch target) they follow
+    void write_table(std::ostream& out, std::span<const uint32_t> program) const;
+    //One "label;pc opcode;cause cycles" line per sample, for flamegraph tools
+    void write_folded(std::ostream& out, std::span<const uint32_t> program) const;
+};
+
+}
@@ -1,11 +1,13 @@
 #pragma once
 #include <deque>
 #include <tuple>
+#include <vector>
 
 #include "dma.h"
 #include "blitter.h"
 #include "defs_pkg.h"
 #include "cycle_defer.h"
+#include "counters.h"
 
 namespace vpu {
 
@@ -24,14 +26,18 @@ class Scheduler {
     //Frontends maintain state for setting up commands
     //uint32_t is the earliest time it can be submitted
     DMA::Command core_dma_frontend_state;
-    std::deque<Defer<DMA::Command>> dma_frontend_queue;
+    //One queue per DMA channel
+    std::vector<std::deque<Defer<DMA::Command>>> dma_frontend_queues;
     Blitter::Command core_blitter_frontend_state;
     std::deque<Defer<Blitter::Command>> blitter_frontend_queue;
 
 
-    //Outstanding request count
-    uint32_t dma_outstanding = 0;
-    void dma_complete();
+    //Outstanding request count, per DMA channel
+    std::vector<uint32_t> dma_outstanding;
+    void dma_complete(uint32_t channel);
+    //Channel with the fewest outstanding commands that has queue space, NO_CHANNEL if none
+    static constexpr uint32_t NO_CHANNEL = 0xFFFFFFFF;
+    uint32_t dma_channel_for_submit() const;
     uint32_t blitter_outstanding = 0;
     void blitter_complete();
 
@@ -39,8 +45,14 @@ class Scheduler {
     bool submit_sched(uint32_t valid_cycle, defs::Opcode opcode, uint32_t val1, uint32_t val2);
     bool submit_blitter(uint32_t valid_cycle, defs::Opcode opcode, uint32_t val1, uint32_t val2);
 
-    void check_dma();
+    void check_dma(uint32_t channel);
     void check_blitter();
+    template <typename Command>
+    static uint32_t frontend_event_cycle(std::deque<Defer<Command>>& queue, bool pipe_busy);
+
+    //Frontend queue length each cycle, summed over the DMA channels
+    vpu::stats::Histogram dma_queue_occupancy;
+    vpu::stats::Histogram blitter_queue_occupancy{vpu::defs::SCHEDULER_FRONTEND_QUEUE_SIZE + 1};
 public:
     Scheduler(
         DMA& dma,
@@ -51,9 +63,17 @@ public:
     //Returns true if successful, false if there is unsufficient internal buffer space
     //Core is expected to stall if this returns false
     bool core_submit(uint32_t valid_cycle, defs::Opcode opcode, uint32_t val1, uint32_t val2);
+    //Whether core_submit would accept opcode now
+    bool can_accept(defs::Opcode opcode);
     
     //Take the submit instructions and send to appropriate pipeline 
     void run_cycle();
+    //First cycle from now where run_cycle passes a command on, NO_EVENT while every queue is
+    //empty or refused by a busy pipe
+    uint32_t next_event_cycle();
+    //Same as that many calls to run_cycle while there is no event
+    void skip_cycles(uint32_t cycles);
+    void register_counters(vpu::stats::Registry& registry);
 };
 
 }
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <span>
+#include <string>
+
+#include "defs_pkg.h"
+
+namespace vpu::trace {
+
+//Opcode held by each pipeline stage in a cycle: fetch, decode, execute, memory, writeback
+constexpr size_t STAGE_COUNT = 5;
+struct StageStatus {
+    bool valid;
+    vpu::defs::Opcode opcode;
+};
+using PipelineStatus = std::array<StageStatus,STAGE_COUNT>;
+
+//Text layout shared by --pipeline/--trace and vpu_trace
+std::string pipeline_heading();
+std::string pipeline_string(const PipelineStatus& stages);
+std::string registers_string(std::span<const uint32_t> registers, std::span<const bool> flags);
+
+//Binary trace ring file, all fields little endian:
+//  header: magic "VPUT", version, record size, register/flag/stage counts, capacity in records,
+//          records written in total, register and flag state before the oldest record
+//  then capacity records, record n is stored in slot n % capacity.
+//Each record only holds the registers that changed since the record before it, the header base
+//state is advanced as the oldest record is overwritten so the ring can always be replayed.
+constexpr std::array<char,4> TRACE_MAGIC = {'V','P','U','T'};
+constexpr uint32_t TRACE_VERSION = 1;
+constexpr size_t MAX_REGISTERS = 16;
+constexpr size_t MAX_FLAGS = 8;
+static_assert(vpu::defs::REGISTER_COUNT <= MAX_REGISTERS && vpu::defs::FLAG_COUNT <= MAX_FLAGS,
+              "Register and flag masks are too narrow");
+
+struct TraceHeader {
+    std::array<char,4> magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t register_count;
+    uint32_t flag_count;
+    uint32_t stage_count;
+    uint64_t capacity;
+    uint64_t written;
+    std::array<uint32_t,MAX_REGISTERS> base_registers;
+    uint32_t base_flags;
+    uint32_t reserved[5];
+};
+
+struct TraceRecord {
+    uint32_t cycle;
+    uint32_t pc;
+    uint16_t changed;     //Bit per register, set when its entry in registers is valid
+    uint8_t flags;        //Bit per flag
+    uint8_t stage_valid;  //Bit per stage with an opcode
+    std::array<uint16_t,STAGE_COUNT> opcodes;
+    std::array<uint32_t,vpu::defs::REGISTER_COUNT> registers;
+};
+
+static_assert(sizeof(TraceHeader) == 128, "Trace header must be packed");
+
+//Appends a record per cycle to a memory mapped ring file
+class TraceWriter {
+    int fd = -1;
+    TraceHeader* header = nullptr;
+    TraceRecord* records = nullptr;
+    size_t mapped_size = 0;
+    //State as of the last record, to find what changed
+    std::array<uint32_t,vpu::defs::REGISTER_COUNT> last_registers{};
+
+public:
+    //registers and flags are the state before the first record
+    TraceWriter(const std::string& path, uint64_t capacity,
+                std::span<const uint32_t> registers, std::span<const bool> flags);
+    ~TraceWriter();
+    TraceWriter(const TraceWriter&) = delete;
+    TraceWriter& operator=(const TraceWriter&) = delete;
+
+    void record(uint32_t cycle, std::span<const uint32_t> registers, std::span<const bool> flags,
+                const PipelineStatus& stages);
+};
+
+}
@@ -0,0 +1,99 @@
+#include "async_writer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+namespace vpu::output {
+
+AsyncWriter::AsyncWriter(int fd, size_t budget, bool drop_when_full) :
+    chunks(std::max<size_t>(2, budget / CHUNK_SIZE)),
+    fd(fd),
+    drop_when_full(drop_when_full)
+{
+    for (auto& chunk : chunks)
+        chunk.data = std::make_unique<char[]>(CHUNK_SIZE);
+    thread = std::thread([this]() { run(); });
+}
+
+AsyncWriter::~AsyncWriter() {
+    //Write out everything first, the writer may stop as soon as it sees closing. The empty chunk
+    //published after only wakes it up, so it does not matter if that one is never written.
+    flush();
+    closing.store(true);
+    publish(false);
+    thread.join();
+    if (dropped)
+        std::cerr << "Output buffer was full, dropped " << dropped << " bytes of output" << std::endl;
+}
+
+void AsyncWriter::publish(bool may_drop) {
+    uint64_t t = tail.load(std::memory_order_relaxed);
+    if (may_drop && t + 1 - head.load(std::memory_order_acquire) >= chunks.size()) {
+        //No chunk would be free to continue into, discard this one instead
+        dropped += chunks[t % chunks.size()].used;
+        chunks[t % chunks.size()].used = 0;
+        return;
+    }
+    tail.store(++t, std::memory_order_release);
+    tail.notify_one();
+
+    //Wait for the chunk we continue into to be written out
+    uint64_t h;
+    while (t - (h = head.load(std::memory_order_acquire)) >= chunks.size())
+        head.wait(h);
+    chunks[t % chunks.size()].used = 0;
+}
+
+void AsyncWriter::write(std::string_view text) {
+    while (text.size()) {
+        Chunk* chunk = &chunks[tail.load(std::memory_order_relaxed) % chunks.size()];
+        if (chunk->used && chunk->used + text.size() > CHUNK_SIZE) {
+            publish(drop_when_full);
+            chunk = &chunks[tail.load(std::memory_order_relaxed) % chunks.size()];
+        }
+        size_t length = std::min(text.size(), CHUNK_SIZE - chunk->used);
+        std::memcpy(chunk->data.get() + chunk->used, text.data(), length);
+        chunk->used += length;
+        text.remove_prefix(length);
+    }
+}
+
+void AsyncWriter::flush() {
+    if (chunks[tail.load(std::memory_order_relaxed) % chunks.size()].used)
+        publish(false);
+    uint64_t h;
+    while ((h = head.load(std::memory_order_acquire)) != tail.load(std::memory_order_relaxed))
+        head.wait(h);
+}
+
+void AsyncWriter::run() {
+    bool failed = false;
+    uint64_t h = head.load(std::memory_order_relaxed);
+    while (true) {
+        uint64_t t;
+        while ((t = tail.load(std::memory_order_acquire)) == h) {
+            if (closing.load()) return;
+            tail.wait(t);
+        }
+        for (; h != t; h++) {
+            Chunk& chunk = chunks[h % chunks.size()];
+            for (size_t done = 0; !failed && done < chunk.used;) {
+                ssize_t written = ::write(fd, chunk.data.get() + done, chunk.used - done);
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0) {
+                    //Keep draining so the producer never waits on a dead file
+                    std::cerr << "Failed to write output: " << std::strerror(errno) << std::endl;
+                    failed = true;
+                    break;
+                }
+                done += written;
+            }
+            head.store(h + 1, std::memory_order_release);
+            head.notify_one();
+        }
+    }
+}
+
+}
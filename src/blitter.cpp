@@ -1,5 +1,6 @@
 #include "blitter.h"
 #include "defs_pkg.h"
+#include "host_timer.h"
 #include <algorithm>
 #include <assert.h>
 #include <cstdint>
@@ -21,11 +22,11 @@ uint32_t Blitter::next_address() {
 
 void Blitter::pixel_cycle() {
     memory->write_word(next_address(), working_command.colour);
+    counters.bytes_moved += defs::FRAMEBUFFER_PIXEL_BYTES;
     state = FINISHED;
 }
 
 void Blitter::clear_cycle() {
-    std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> data;
     assert(vpu::defs::MEM_ACCESS_WIDTH == 4 * vpu::defs::BLITTER_MAX_PIXELS);
 
     if (working_command.ypos >= defs::FRAMEBUFFER_HEIGHT) {
@@ -33,16 +34,17 @@ void Blitter::clear_cycle() {
         return;
     }
 
+    uint32_t write_addr = next_address();
+    assert((write_addr & 0x3F) == 0); //for now only allow 512-bit aligned writes
+    auto data = memory->write_line(write_addr);
+
     for (int i = 0; i < defs::BLITTER_MAX_PIXELS; i++) {
         data[4*i]   = working_command.colour >> 24;
         data[4*i+1] = (working_command.colour >> 16) & 0xFF;
         data[4*i+2] = (working_command.colour >> 8) & 0xFF;
         data[4*i+3] = working_command.colour & 0xFF;
     }
-
-    uint32_t write_addr = next_address();
-    assert((write_addr & 0x3F) == 0); //for now only allow 512-bit aligned writes
-    memory->write(write_addr, data);
+    counters.bytes_moved += vpu::defs::MEM_ACCESS_WIDTH;
 
     //Will overwrite end of buffer, but that should be ok for now
     working_command.xpos += defs::BLITTER_MAX_PIXELS;
@@ -53,12 +55,17 @@ void Blitter::clear_cycle() {
 }
 
 void Blitter::run_cycle(){
+    HOST_TIMER(BLITTER);
     if (finished_callback_valid) {
         finished_callback();
         finished_callback_valid = false;
     }
 
-    if (state == IDLE) return;
+    if (state == IDLE) {
+        counters.idle_cycles++;
+        return;
+    }
+    counters.busy_cycles++;
     if (state == FINISHED) {
         state = IDLE;
         return;
@@ -76,33 +83,94 @@ void Blitter::run_cycle(){
     }
 
     if (state == FINISHED) {
+        dma.claim_writes(0, 0);
         finished_callback = working_callback;
         finished_callback_valid = true;
     }
 }
 
-Blitter::Blitter(std::unique_ptr<vpu::mem::Memory>& memory)
-    : memory(memory)
+Blitter::Blitter(std::unique_ptr<vpu::mem::Memory>& memory, DMA& dma)
+    : memory(memory),
+      dma(dma)
 {
 }
 
-bool Blitter::submit(Command command, std::function<void()> completion_callback) {
-    if (state == WORKING) {
-        return false;
-    }
-
+void Blitter::start(Command command) {
     assert(command.operation != NONE);
 
     state = WORKING;
-    work_cycle = vpu::defs::get_next_global_cycle();
     working_command = command;
-    working_callback = completion_callback;
     if (working_command.operation == CLEAR){
         working_command.xpos = 0;
         working_command.ypos = 0;
+        dma.claim_writes(defs::FRAMEBUFFER_ADDR, defs::FRAMEBUFFER_BYTES);
+    } else {
+        dma.claim_writes(next_address(), defs::FRAMEBUFFER_PIXEL_BYTES);
     }
-    
+}
+
+bool Blitter::submit(Command command, std::function<void()> completion_callback) {
+    if (state == WORKING) {
+        return false;
+    }
+
+    start(command);
+    work_cycle = vpu::defs::get_next_global_cycle();
+    working_callback = completion_callback;
     return true;
 }
 
+void Blitter::execute(Command command) {
+    assert(state == IDLE);
+    start(command);
+    //Every cycle back to back, giving the same memory result as the timed model
+    while (state != FINISHED) {
+        switch(working_command.operation) {
+            case PIXEL: pixel_cycle(); break;
+            case CLEAR: clear_cycle(); break;
+
+            default:
+                std::cerr << "Invalid Blitter operation ";
+                assert(false);
+        }
+    }
+    dma.claim_writes(0, 0);
+    state = IDLE;
+}
+
+//Cycle on which a clear finds no lines left and completes, with every earlier cycle writing one
+uint32_t Blitter::clear_finish_cycle() const {
+    uint32_t total = defs::FRAMEBUFFER_WIDTH * defs::FRAMEBUFFER_HEIGHT;
+    uint32_t pixel = working_command.ypos * defs::FRAMEBUFFER_WIDTH + working_command.xpos;
+    uint32_t lines = pixel < total ? (total - pixel + defs::BLITTER_MAX_PIXELS - 1) / defs::BLITTER_MAX_PIXELS : 0;
+    return std::max(vpu::defs::get_global_cycle(), work_cycle) + lines;
+}
+
+uint32_t Blitter::next_event_cycle() const {
+    if (finished_callback_valid || state == FINISHED) return vpu::defs::get_global_cycle();
+    if (state == IDLE) return NO_EVENT;
+    if (working_command.operation == CLEAR) return clear_finish_cycle();
+    return vpu::defs::get_global_cycle();
+}
+
+void Blitter::skip_cycles(uint32_t cycles) {
+    assert(!finished_callback_valid);
+    if (state == IDLE) {
+        counters.idle_cycles += cycles;
+        return;
+    }
+    //Only a clear short of its last cycle is skipped while busy, its lines are still written
+    uint32_t now = vpu::defs::get_global_cycle();
+    assert(state == WORKING && working_command.operation == CLEAR && now + cycles <= clear_finish_cycle());
+    counters.busy_cycles += cycles;
+    for (uint32_t cycle = std::max(now, work_cycle); cycle < now + cycles; cycle++)
+        clear_cycle();
+}
+
+void Blitter::register_counters(vpu::stats::Registry& registry) {
+    registry.counter("blitter", "busy_cycles", counters.busy_cycles, "Cycles with a command in progress");
+    registry.counter("blitter", "idle_cycles", counters.idle_cycles, "Cycles without a command");
+    registry.counter("blitter", "bytes_moved", counters.bytes_moved, "Bytes written to memory");
+}
+
 }
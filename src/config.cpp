@@ -1,5 +1,7 @@
 #include "config.h"
+#include "defs_pkg.h"
 #include <iostream>
+#include <limits>
 #include <vector>
 #include <string>
 #include <unordered_map>
@@ -34,12 +36,69 @@ Config::OptArg Config::OptArg::OptString(std::string l, std::string s, std::stri
     return arg;
 }
 
+Config::OptArg Config::OptArg::OptStringList(std::string l, std::string s, std::string d) {
+    OptArg arg;
+    arg.long_name = l;
+    arg.short_name = s;
+    arg.description = d;
+    arg.count = 0;
+    arg.max_count = std::numeric_limits<uint>::max();
+    arg.type = ArgType::STRING_LIST;
+    arg.value = std::vector<std::string>();
+    return arg;
+}
+
+//A whole number from 1 to max, exits naming what it is otherwise
+static uint64_t parse_count(const std::string& value, uint64_t max, const std::string& name) {
+    size_t end = 0;
+    unsigned long long count = 0;
+    try {
+        count = std::stoull(value, &end, 0);
+    } catch (std::exception&) {
+        end = 0;
+    }
+    //stoull takes a minus sign and wraps the number round
+    if (value.find('-') != std::string::npos || end != value.size() || count == 0 || count > max) {
+        std::cerr << "Invalid " << name << " '" << value << "'. Expected 1 to " << max << std::endl;
+        exit(1);
+    }
+    return count;
+}
+
 bool Config::validate() {
     if (!fs::exists(input_file)) {
         std::cerr << "Provided input program " << input_file << " cannot be found" << std::endl;
         return false;
     }
 
+    if (functional && (pipeline || trace || step || trace_file != "" || pipeview != "" || profile != "" || profile_folded != "")) {
+        std::cerr << "--functional does not model cycles, it cannot be combined with --pipeline, --trace, --trace_file, --pipeview, --profile or --step" << std::endl;
+        return false;
+    }
+
+    if ((dump_mem_ranges.size() || dump_mem_digest) && dump_mem == "") {
+        std::cerr << "--dump_mem_range and --dump_mem_digest need an output file from --dump_mem" << std::endl;
+        return false;
+    }
+
+    if (dump_mem_compress && dump_mem == "") {
+        std::cerr << "--dump_mem_compress needs an output file from --dump_mem" << std::endl;
+        return false;
+    }
+
+    if (dump_mem_compress && (dump_mem_ranges.size() || dump_mem_digest)) {
+        std::cerr << "--dump_mem_compress always dumps the full memory, it cannot be combined with --dump_mem_range or --dump_mem_digest" << std::endl;
+        return false;
+    }
+
+    for (auto& range : dump_mem_ranges) {
+        if ((uint64_t)range.address + range.length > vpu::defs::MEM_SIZE) {
+            std::cerr << "Memory dump range 0x" << std::hex << range.address << ":0x" << range.length;
+            std::cerr << " extends beyond the end of memory 0x" << vpu::defs::MEM_SIZE << std::dec << std::endl;
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -63,9 +122,26 @@ Config parse_arguments(int argc, char *argv[]) {
         {"dump",      Config::OptArg::OptBoolean("--dump",      "-d", "Dump a human readable copy of the input program")},
         {"pipeline",  Config::OptArg::OptBoolean("--pipeline",  "-p", "Print pipeline state")},
         {"trace",     Config::OptArg::OptBoolean("--trace",     "-t", "Print core state each clock")},
+        {"trace_file", Config::OptArg::OptString("--trace_file", "-T", "Record core state each clock to a binary ring file, decode with vpu_trace")},
+        {"trace_ring", Config::OptArg::OptString("--trace_ring", "-N", "Number of clocks kept by --trace_file, older ones are overwritten (default 1048576)")},
+        {"pipeview",  Config::OptArg::OptString( "--pipeview",  "-k", "Write each instruction's pipeline stages to a Kanata log for the Konata viewer")},
+        {"output_buffer", Config::OptArg::OptString("--output_buffer", "-O", "MiB of --pipeline/--trace output buffered for the writer thread (default 16)")},
+        {"output_policy", Config::OptArg::OptString("--output_policy", "-P", "When the output buffer is full: block (default) or drop")},
         {"step",      Config::OptArg::OptBoolean("--step",      "-s", "Step a specific number of instructions")},
+        {"functional", Config::OptArg::OptBoolean("--functional", "-f", "Run an instruction at a time interpreter instead of the pipeline, pipes complete instantly")},
         {"dump_regs", Config::OptArg::OptString( "--dump_regs", "-r", "Dump the register state in a file after completion")},
         {"dump_mem", Config::OptArg::OptString( "--dump_mem",  "-m", "Dump the memory buffer in a file after completion")},
+        {"dump_mem_range", Config::OptArg::OptStringList("--dump_mem_range", "-R", "Restrict --dump_mem to an addr:len range, can be repeated")},
+        {"dump_mem_digest", Config::OptArg::OptBoolean("--dump_mem_digest", "-g", "Write a hash of each --dump_mem range instead of the data")},
+        {"dump_mem_compress", Config::OptArg::OptBoolean("--dump_mem_compress", "-z", "Write --dump_mem as a compressed sparse dump, expand with vpu_undump")},
+        {"stats",     Config::OptArg::OptBoolean("--stats",     "-S", "Print performance counters after completion")},
+        {"stats_json", Config::OptArg::OptString("--stats_json", "-J", "Write performance counters as JSON to a file after completion")},
+        {"profile",   Config::OptArg::OptString( "--profile",   "-x", "Write a table of cycles spent at each guest PC to a file after completion")},
+        {"profile_folded", Config::OptArg::OptString("--profile_folded", "-X", "Write guest cycles as folded stacks (label;pc;cause) for flamegraph tools")},
+        {"memory",    Config::OptArg::OptString( "--memory",    "-b", "Memory backend: paged (default), dense, thp or hugetlb")},
+        {"dma_channels", Config::OptArg::OptString("--dma_channels", "-C", "Number of DMA channels sharing the memory port (default 1)")},
+        {"dma_latency", Config::OptArg::OptString("--dma_latency", "-L", "Cycles from a DMA read being issued to its data returning (default 1)")},
+        {"dma_reads", Config::OptArg::OptString("--dma_reads", "-Q", "DMA reads each channel can have in flight (default 1)")},
     };
 
     bool print_help = false;
@@ -96,6 +172,7 @@ Config parse_arguments(int argc, char *argv[]) {
                             attrs.value = true;
                             break;
                         case Config::OptArg::ArgType::STRING:
+                        case Config::OptArg::ArgType::STRING_LIST:
                             expecting_optional = true;
                             optional_value_target = name;
                             break;
@@ -111,8 +188,13 @@ Config parse_arguments(int argc, char *argv[]) {
             found = true;
             expecting_optional = false;
             assert(optional_arguments.count(optional_value_target) == 1);
-            assert(optional_arguments[optional_value_target].type == Config::OptArg::ArgType::STRING);
-            optional_arguments[optional_value_target].value = argv[i];
+            auto& target = optional_arguments[optional_value_target];
+            if (target.type == Config::OptArg::ArgType::STRING_LIST) {
+                std::get<std::vector<std::string>>(target.value).push_back(argv[i]);
+            } else {
+                assert(target.type == Config::OptArg::ArgType::STRING);
+                target.value = argv[i];
+            }
         } else {
             found = true;
             if (positional_arguments_seen >= positional_arguments.size()){
@@ -191,10 +273,80 @@ Config parse_arguments(int argc, char *argv[]) {
     config.dump = std::get<bool>(optional_arguments["dump"].value);
     config.pipeline = std::get<bool>(optional_arguments["pipeline"].value);
     config.trace = std::get<bool>(optional_arguments["trace"].value);
+    config.trace_file = std::get<std::string>(optional_arguments["trace_file"].value);
+    std::string trace_ring = std::get<std::string>(optional_arguments["trace_ring"].value);
+    if (trace_ring != "")
+        config.trace_ring = parse_count(trace_ring, std::numeric_limits<uint64_t>::max(), "trace ring size");
+    config.pipeview = std::get<std::string>(optional_arguments["pipeview"].value);
+    std::string output_buffer = std::get<std::string>(optional_arguments["output_buffer"].value);
+    if (output_buffer != "")
+        config.output_buffer = parse_count(output_buffer, MAX_OUTPUT_BUFFER_MIB, "output buffer size in MiB") << 20;
+    std::string output_policy = std::get<std::string>(optional_arguments["output_policy"].value);
+    if (output_policy == "" || output_policy == "block") {
+        config.output_policy = Config::OutputPolicy::BLOCK;
+    } else if (output_policy == "drop") {
+        config.output_policy = Config::OutputPolicy::DROP;
+    } else {
+        std::cerr << "Unknown output policy '" << output_policy << "'. Expected block or drop" << std::endl;
+        exit(1);
+    }
     config.step = std::get<bool>(optional_arguments["step"].value);
+    config.functional = std::get<bool>(optional_arguments["functional"].value);
     config.dump_regs = std::get<std::string>(optional_arguments["dump_regs"].value);
     config.dump_mem = std::get<std::string>(optional_arguments["dump_mem"].value);
+    config.dump_mem_digest = std::get<bool>(optional_arguments["dump_mem_digest"].value);
+    config.dump_mem_compress = std::get<bool>(optional_arguments["dump_mem_compress"].value);
+    config.stats = std::get<bool>(optional_arguments["stats"].value);
+    config.stats_json = std::get<std::string>(optional_arguments["stats_json"].value);
+    config.profile = std::get<std::string>(optional_arguments["profile"].value);
+    config.profile_folded = std::get<std::string>(optional_arguments["profile_folded"].value);
+    for (auto& range : std::get<std::vector<std::string>>(optional_arguments["dump_mem_range"].value)) {
+        size_t split = range.find(':');
+        bool valid = split != std::string::npos;
+        unsigned long address = 0;
+        unsigned long length = 0;
+        try {
+            size_t address_end = 0, length_end = 0;
+            if (valid) address = std::stoul(range.substr(0, split), &address_end, 0);
+            if (valid) length = std::stoul(range.substr(split+1), &length_end, 0);
+            valid = valid && address_end == split && length_end == range.size() - split - 1;
+        } catch (std::exception&) {
+            valid = false;
+        }
+        if (!valid || address > std::numeric_limits<uint32_t>::max() || length > std::numeric_limits<uint32_t>::max()) {
+            std::cerr << "Invalid memory range '" << range << "'. Expected addr:len, e.g. 0xF00000:0x10000" << std::endl;
+            exit(1);
+        }
+        config.dump_mem_ranges.push_back({(uint32_t)address, (uint32_t)length});
+    }
+
+#ifdef RPC
     config.inspector = std::get<bool>(optional_arguments["inspect"].value);
+#endif
+
+    std::string memory_backend = std::get<std::string>(optional_arguments["memory"].value);
+    if (memory_backend == "" || memory_backend == "paged") {
+        config.memory_backend = Config::MemoryBackend::PAGED;
+    } else if (memory_backend == "dense") {
+        config.memory_backend = Config::MemoryBackend::DENSE;
+    } else if (memory_backend == "thp") {
+        config.memory_backend = Config::MemoryBackend::DENSE_THP;
+    } else if (memory_backend == "hugetlb") {
+        config.memory_backend = Config::MemoryBackend::DENSE_HUGETLB;
+    } else {
+        std::cerr << "Unknown memory backend '" << memory_backend << "'. Expected one of paged, dense, thp or hugetlb" << std::endl;
+        exit(1);
+    }
+
+    std::string dma_channels = std::get<std::string>(optional_arguments["dma_channels"].value);
+    if (dma_channels != "")
+        config.dma_channels = parse_count(dma_channels, MAX_DMA_CHANNELS, "DMA channel count");
+    std::string dma_latency = std::get<std::string>(optional_arguments["dma_latency"].value);
+    if (dma_latency != "")
+        config.dma_latency = parse_count(dma_latency, MAX_DMA_LATENCY, "DMA read latency");
+    std::string dma_reads = std::get<std::string>(optional_arguments["dma_reads"].value);
+    if (dma_reads != "")
+        config.dma_reads = parse_count(dma_reads, MAX_DMA_READS, "DMA read count");
 
     return config;
 }
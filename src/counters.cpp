@@ -0,0 +1,87 @@
+#include "counters.h"
+#include <iomanip>
+
+namespace vpu::stats {
+
+void Registry::counter(std::string group, std::string name, const uint64_t& value, std::string description) {
+    entries.push_back({Kind::COUNTER, group, name, description, &value});
+}
+
+void Registry::ratio(std::string group, std::string name, const uint64_t& value, const uint64_t& denominator, std::string description) {
+    entries.push_back({Kind::RATIO, group, name, description, &value, &denominator});
+}
+
+void Registry::histogram(std::string group, std::string name, const Histogram& histogram, std::string description) {
+    entries.push_back({Kind::HISTOGRAM, group, name, description, nullptr, nullptr, &histogram});
+}
+
+static double ratio_value(uint64_t value, uint64_t denominator) {
+    return denominator ? (double)value / denominator : 0.0;
+}
+
+void Registry::print_text(std::ostream& out) const {
+    std::ios_base::fmtflags saved_flags = out.flags();
+    std::streamsize saved_precision = out.precision();
+    out << "---------- Statistics ----------\n";
+    for (auto& entry : entries) {
+        std::string name = entry.group + "." + entry.name;
+        out << std::left << std::setw(40) << name << std::right;
+        switch (entry.kind) {
+            case Kind::COUNTER:
+                out << std::setw(16) << *entry.value;
+                break;
+            case Kind::RATIO:
+                out << std::setw(16) << std::fixed << std::setprecision(4) << ratio_value(*entry.value, *entry.denominator);
+                break;
+            case Kind::HISTOGRAM:
+                out << std::setw(16) << "";
+                break;
+        }
+        out << "  # " << entry.description << "\n";
+        if (entry.kind == Kind::HISTOGRAM) {
+            auto& buckets = entry.histogram->buckets;
+            for (size_t i = 0; i < buckets.size(); i++) {
+                std::string bucket = name + "::" + std::to_string(i) + (i + 1 == buckets.size() ? "+" : "");
+                out << std::left << std::setw(40) << bucket << std::right << std::setw(16) << buckets[i] << "\n";
+            }
+        }
+    }
+    out << "--------------------------------" << std::endl;
+    out.flags(saved_flags);
+    out.precision(saved_precision);
+}
+
+void Registry::print_json(std::ostream& out) const {
+    //Groups become objects, histograms arrays of bucket counts
+    out << "{";
+    std::string group;
+    bool first_in_group = true;
+    for (auto& entry : entries) {
+        if (group.empty() || entry.group != group) {
+            if (!group.empty()) out << "\n  },";
+            group = entry.group;
+            out << "\n  \"" << group << "\": {";
+            first_in_group = true;
+        }
+        out << (first_in_group ? "" : ",") << "\n    \"" << entry.name << "\": ";
+        first_in_group = false;
+        switch (entry.kind) {
+            case Kind::COUNTER:
+                out << *entry.value;
+                break;
+            case Kind::RATIO:
+                out << std::setprecision(6) << ratio_value(*entry.value, *entry.denominator);
+                break;
+            case Kind::HISTOGRAM:
+                out << "[";
+                for (size_t i = 0; i < entry.histogram->buckets.size(); i++)
+                    out << (i ? ", " : "") << entry.histogram->buckets[i];
+                out << "]";
+                break;
+        }
+    }
+    if (!group.empty()) out << "\n  }";
+    out << "\n}" << std::endl;
+}
+
+}
@@ -1,33 +1,242 @@
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <string>
 #include <assert.h>
 
 #include "dma.h"
+#include "host_timer.h"
 
 namespace vpu {
 
-DMA::DMA(std::unique_ptr<vpu::mem::Memory>& memory) :
-    memory(memory)
+DMA::Channel::Channel(DMA& dma, std::unique_ptr<vpu::mem::Memory>& memory, bool line_accurate, uint32_t read_latency, uint32_t max_reads) :
+    dma(dma),
+    memory(memory),
+    read_latency(read_latency),
+    max_reads(max_reads),
+    line_buffer((max_reads + 1) * vpu::defs::MEM_ACCESS_WIDTH),
+    line_accurate(line_accurate)
 {
+    assert(read_latency > 0 && max_reads > 0 && max_reads <= MAX_READS);
+}
+
+DMA::DMA(std::unique_ptr<vpu::mem::Memory>& memory, bool line_accurate, uint32_t channel_count,
+         uint32_t read_latency, uint32_t max_reads)
+{
+    assert(channel_count > 0);
+    channels.reserve(channel_count);
+    for (uint32_t i = 0; i < channel_count; i++)
+        channels.emplace_back(*this, memory, line_accurate, read_latency, max_reads);
+}
+
+//The line by line model reads a copy ahead of its writes, so an overlapping copy can see
+//its own writes. Only copies between separate lines give the same result in one go.
+bool DMA::Channel::can_bulk(const Command& command) const {
+    if (line_accurate || command.length == 0) return false;
+    if (dma.claimed(command.dest, command.length)) return false;
+    if (command.operation == SET) return true;
+    if (dma.claimed(command.source, command.length)) return false;
+    uint32_t width = vpu::defs::MEM_ACCESS_WIDTH;
+    uint32_t source_start = command.source & ~(width - 1);
+    uint32_t source_end = command.source + command.length + width - 1;
+    uint32_t dest_start = command.dest & ~(width - 1);
+    uint32_t dest_end = command.dest + command.length + width - 1;
+    return source_end <= dest_start || dest_end <= source_start;
+}
+
+void DMA::Channel::bulk_transfer() {
+    switch(working_command.operation){
+        case COPY:
+            memory->copy(working_command.dest, working_command.source, working_command.length);
+            break;
+        case SET:
+            memory->fill(working_command.dest, working_command.value, working_command.length);
+            break;
+        default:
+            std::cerr << "Invalid DMA operation ";
+            assert(false);
+    }
+    counters.bytes_moved += working_command.length;
+    state = FINISHED;
+}
+
+void DMA::Channel::start(DMA::Command command) {
+    assert(command.operation != NONE);
+    state = WORKING;
+    bulk = false;
+    descriptor_pending = command.operation == COPY && command.length == 0;
+    next_descriptor = descriptor_pending ? command.source : 0;
+    chain_length = 0;
+    if (!descriptor_pending) start_transfer(command);
+}
+
+void DMA::Channel::start_transfer(DMA::Command command) {
+    working_command = command;
+    rows_left = std::max<uint32_t>(command.height, 1);
+    //Rows step forward from the first, so the last row of each range is the furthest
+    uint64_t dest_end = command.dest + (uint64_t)(rows_left - 1) * command.dest_stride + command.length;
+    uint64_t source_end = command.source + (uint64_t)(rows_left - 1) * command.source_stride + command.length;
+    if (dest_end > vpu::defs::MEM_SIZE || (command.operation == COPY && source_end > vpu::defs::MEM_SIZE)) {
+        std::cerr << "DMA transfer of " << rows_left << " rows of 0x" << std::hex << command.length;
+        std::cerr << " bytes from 0x" << command.source << " to 0x" << command.dest;
+        std::cerr << " extends beyond the end of memory" << std::dec << std::endl;
+        exit(1);
+    }
+    start_row();
+}
+
+//Work on the row starts on the next cycle
+void DMA::Channel::start_row() {
+    state = WORKING;
+    progress.write_pointer = working_command.dest & 0xFFFFFFC0;
+    progress.read_pointer = working_command.source & 0xFFFFFFC0;
+    progress.reads_head = 0;
+    progress.reads_count = 0;
+    progress.in_flight_bytes = 0;
+    progress.buffered = 0;
+    progress.edge_fetched = false;
+    line_head = 0;
+    bulk = false;
+    finish_valid = false;
+    if (!can_bulk(working_command)) return;
+    //Another bulk row the new one overlaps can no longer be left to move in one go either
+    dma.sync(working_command.dest, working_command.length, true);
+    if (working_command.operation == COPY) dma.sync(working_command.source, working_command.length, false);
+    bulk = true;
+}
+
+//Everything the row has written so far goes to memory now, and the reads not yet written
+//take the source bytes that follow. Nothing else has touched either range since the row
+//started, or it would have left bulk then.
+void DMA::Channel::leave_bulk() {
+    uint32_t end = working_command.dest + working_command.length;
+    uint32_t written = progress.write_pointer > working_command.dest
+        ? std::min(progress.write_pointer, end) - working_command.dest : 0;
+    if (working_command.operation == COPY) {
+        memory->copy(working_command.dest, working_command.source, written);
+        uint32_t held = progress.buffered + progress.in_flight_bytes;
+        uint32_t width = vpu::defs::MEM_ACCESS_WIDTH;
+        for (uint32_t i = 0; i < held;) {
+            uint32_t address = working_command.source + written + i;
+            auto line = memory->read_line(address & ~(width - 1));
+            uint32_t offset = address & (width - 1);
+            uint32_t chunk = std::min(width - offset, held - i);
+            std::copy(line.begin() + offset, line.begin() + offset + chunk, line_buffer.begin() + i);
+            i += chunk;
+        }
+    } else {
+        memory->fill(working_command.dest, working_command.value, written);
+    }
+    line_head = 0;
+    counters.bytes_moved += written;
+    bulk = false;
+    finish_valid = false;
+}
+
+//Reading a descriptor takes the cycle, its transfer starts on the next one
+void DMA::Channel::fetch_descriptor() {
+    uint32_t address = next_descriptor;
+    if (address % DESCRIPTOR_ALIGN != 0) {
+        std::cerr << "DMA descriptor at 0x" << std::hex << address << " is not ";
+        std::cerr << std::dec << DESCRIPTOR_ALIGN << "-byte aligned" << std::endl;
+        exit(1);
+    }
+    //A descriptor fills its aligned block
+    if (address > vpu::defs::MEM_SIZE - DESCRIPTOR_ALIGN) {
+        std::cerr << "DMA descriptor at 0x" << std::hex << address << " is beyond the end of memory" << std::dec << std::endl;
+        exit(1);
+    }
+    if (chain_length > 0 && address == chain_mark) {
+        std::cerr << "DMA descriptor chain loops back to 0x" << std::hex << address << std::dec << std::endl;
+        exit(1);
+    }
+    chain_length++;
+    if ((chain_length & (chain_length - 1)) == 0) chain_mark = address;
+    dma.sync(address, DESCRIPTOR_ALIGN, false);
+    Command command;
+    command.source = memory->read_word(address);
+    command.dest = memory->read_word(address + 4);
+    command.length = memory->read_word(address + 8);
+    uint32_t control = memory->read_word(address + 12);
+    next_descriptor = memory->read_word(address + 16);
+    command.height = memory->read_word(address + 20);
+    command.source_stride = memory->read_word(address + 24);
+    command.dest_stride = memory->read_word(address + 28);
+    command.operation = (Operation)(control & 0xFF);
+    command.value = (control >> 8) & 0xFF;
+    if (command.operation != COPY && command.operation != SET) {
+        std::cerr << "Invalid DMA operation " << (control & 0xFF);
+        std::cerr << " in descriptor at 0x" << std::hex << address << std::dec << std::endl;
+        exit(1);
+    }
+    counters.descriptors++;
+    descriptor_pending = false;
 
+    //Nothing to move, carry straight on with the chain
+    if (command.length == 0) {
+        rows_left = 0;
+        state = FINISHED;
+        return;
+    }
+    start_transfer(command);
 }
 
-bool DMA::submit(DMA::Command command, std::function<void()> completion_callback) {
+//Called when a row finishes, false while a 2D transfer or a chain carries on
+bool DMA::Channel::command_done() {
+    //The next row follows straight on, with the same edge handling as any transfer
+    if (rows_left > 1) {
+        rows_left--;
+        working_command.source += working_command.source_stride;
+        working_command.dest += working_command.dest_stride;
+        start_row();
+        return false;
+    }
+    rows_left = 0;
+    if (next_descriptor == 0) return true;
+    state = WORKING;
+    descriptor_pending = true;
+    return false;
+}
+
+bool DMA::Channel::submit(DMA::Command command, std::function<void()> completion_callback) {
     if (state == WORKING){ //Can accept input when idle or on last cycle of work
         return false;
     }
-    assert(command.operation != NONE);
-    assert(command.dest < vpu::defs::MEM_SIZE);
-    assert(command.dest + command.length < vpu::defs::MEM_SIZE);
 
-    state = WORKING; 
+    start(command);
     work_cycle = vpu::defs::get_next_global_cycle();
-    working_command = command;
     working_callback = completion_callback;
-    write_pointer = command.dest & 0xFFFFFFC0;
-    read_pointer = command.source & 0xFFFFFFC0;
     return true;
 }
 
+void DMA::Channel::execute(DMA::Command command) {
+    assert(state == IDLE);
+    start(command);
+    //Every cycle back to back on a clock of its own, giving the same memory result as the
+    //timed model
+    uint32_t cycle = 0;
+    do {
+        if (descriptor_pending) {
+            fetch_descriptor();
+        } else if (bulk) {
+            bulk_transfer();
+        } else {
+            Access next = next_access(progress, cycle);
+            if (next != NO_ACCESS) access(next, cycle);
+        }
+        cycle++;
+    } while (state != FINISHED || !command_done());
+    state = IDLE;
+}
+
+bool DMA::submit(uint32_t channel, DMA::Command command, std::function<void()> completion_callback) {
+    assert(channel < channels.size());
+    return channels[channel].submit(command, completion_callback);
+}
+
+void DMA::execute(DMA::Command command) {
+    channels[0].execute(command);
+}
 
 /*
 TODO
@@ -38,152 +247,306 @@ Things like read and writes with different alignment will generate a lot of extr
 
 */
 
-void DMA::copy_cycle() {
-    assert(write_pointer < working_command.dest + working_command.length);
-    
-    //Always read buffer if not containing an entire line, and the read pointer hasn't reached the end
-    bool add_to_buffer = active_buffer_size < vpu::defs::MEM_ACCESS_WIDTH && read_pointer < working_command.source + working_command.length;
+std::pair<uint32_t,uint32_t> DMA::Channel::source_range(uint32_t address) const {
+    uint32_t end = working_command.source + working_command.length;
+    return {
+        working_command.source > address ? working_command.source - address : 0,
+        std::min(address + vpu::defs::MEM_ACCESS_WIDTH, end) - address
+    };
+}
+
+std::pair<uint32_t,uint32_t> DMA::Channel::dest_range(uint32_t address) const {
+    uint32_t end = working_command.dest + working_command.length;
+    return {
+        working_command.dest > address ? working_command.dest - address : 0,
+        std::min(address + vpu::defs::MEM_ACCESS_WIDTH, end) - address
+    };
+}
 
-    if (add_to_buffer){
-        std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> fetched_read_data = memory->read(read_pointer);
+//Reads are issued as long as there is room for them, so they run ahead of the writes. A
+//write waits for its source bytes, and a partial write first fetches the line it merges into.
+DMA::Channel::Access DMA::Channel::next_access(Progress& progress, uint32_t cycle) const {
+    while (progress.reads_count && progress.reads[progress.reads_head].ready_cycle <= cycle) {
+        progress.buffered += progress.reads[progress.reads_head].bytes;
+        progress.in_flight_bytes -= progress.reads[progress.reads_head].bytes;
+        progress.reads_head = (progress.reads_head + 1) % max_reads;
+        progress.reads_count--;
+    }
 
-        //When the return data overlaps the start offset forwards into the buffer
-        uint32_t start_offset = working_command.source > read_pointer ? working_command.source - read_pointer : 0;
+    bool copy = working_command.operation == COPY;
+    if (copy
+        && progress.read_pointer < working_command.source + working_command.length
+        && progress.reads_count < max_reads
+        && progress.buffered + progress.in_flight_bytes < max_reads * vpu::defs::MEM_ACCESS_WIDTH)
+        return READ;
 
-        //When the return data overlaps the end, offset backwards from the end
-        uint32_t end_offset = 
-            (read_pointer + vpu::defs::MEM_ACCESS_WIDTH) >= (working_command.source + working_command.length) ?
-                vpu::defs::MEM_ACCESS_WIDTH - ((read_pointer + vpu::defs::MEM_ACCESS_WIDTH) - (working_command.source + working_command.length)) :
-                vpu::defs::MEM_ACCESS_WIDTH;
+    auto [start_offset, end_offset] = dest_range(progress.write_pointer);
+    if (start_offset != 0 || end_offset != vpu::defs::MEM_ACCESS_WIDTH) {
+        if (!progress.edge_fetched) return EDGE_FETCH;
+        if (cycle < progress.edge_ready_cycle) return NO_ACCESS;
+    }
+    if (copy && progress.buffered < end_offset - start_offset) return NO_ACCESS;
+    return WRITE;
+}
 
-        //New entry to active buffer
-        if (!active_buffer_valid) {
-            active_buffer_valid = true;
-            active_buffer_address = working_command.source;
+void DMA::Channel::advance(Progress& progress, Access access, uint32_t cycle) const {
+    switch (access) {
+        case READ: {
+            auto [start_offset, end_offset] = source_range(progress.read_pointer);
+            uint32_t slot = (progress.reads_head + progress.reads_count) % max_reads;
+            progress.reads[slot] = {cycle + read_latency, end_offset - start_offset};
+            progress.reads_count++;
+            progress.in_flight_bytes += end_offset - start_offset;
+            progress.read_pointer += vpu::defs::MEM_ACCESS_WIDTH;
+            break;
+        }
+        case EDGE_FETCH:
+            progress.edge_fetched = true;
+            progress.edge_ready_cycle = cycle + read_latency;
+            break;
+        case WRITE: {
+            auto [start_offset, end_offset] = dest_range(progress.write_pointer);
+            if (working_command.operation == COPY) progress.buffered -= end_offset - start_offset;
+            //Fetched line is used up by the write
+            progress.edge_fetched = false;
+            //Write pointer always updates by full width
+            progress.write_pointer += vpu::defs::MEM_ACCESS_WIDTH;
+            break;
         }
-        uint32_t active_offset = active_buffer_size;
-        active_buffer_size += end_offset - start_offset;
+        default:
+            assert(false);
+    }
+}
 
-        std::copy(
-            fetched_read_data.begin() + start_offset,
-            fetched_read_data.begin() + end_offset,
-            active_buffer.begin() + active_offset
-        );
+bool DMA::Channel::row_done(const Progress& progress) const {
+    return progress.write_pointer >= working_command.dest + working_command.length;
+}
 
-        read_pointer += vpu::defs::MEM_ACCESS_WIDTH;
-        return;
+//A bulk row keeps the same timing but leaves the data to bulk_transfer
+void DMA::Channel::access(Access access, uint32_t cycle) {
+    if (access == READ && !bulk) {
+        //Data is taken when the read is issued, only the bytes in range are kept
+        auto [start_offset, end_offset] = source_range(progress.read_pointer);
+        dma.sync(progress.read_pointer + start_offset, end_offset - start_offset, false);
+        auto fetched_read_data = memory->read_line(progress.read_pointer);
+        uint32_t tail = (line_head + progress.buffered + progress.in_flight_bytes) % line_buffer.size();
+        uint32_t first = std::min<uint32_t>(end_offset - start_offset, line_buffer.size() - tail);
+        auto read_start = fetched_read_data.begin() + start_offset;
+        std::copy(read_start, read_start + first, line_buffer.begin() + tail);
+        std::copy(read_start + first, fetched_read_data.begin() + end_offset, line_buffer.begin());
+    }
+
+    //The hardware fetches the line first and does a selective copy to avoid overwriting outside
+    //the range. The fetch still costs an access, but only the bytes in range are written in place.
+    if (access == WRITE && !bulk) {
+        auto [start_offset, end_offset] = dest_range(progress.write_pointer);
+        uint32_t write_size = end_offset - start_offset;
+        dma.sync(progress.write_pointer + start_offset, write_size, true);
+        auto line = memory->write_line(progress.write_pointer);
+        if (working_command.operation == COPY) {
+            uint32_t first = std::min<uint32_t>(write_size, line_buffer.size() - line_head);
+            auto head = line_buffer.begin() + line_head;
+            std::copy(head, head + first, line.begin() + start_offset);
+            std::copy(line_buffer.begin(), line_buffer.begin() + (write_size - first), line.begin() + start_offset + first);
+            line_head = (line_head + write_size) % line_buffer.size();
+        } else {
+            std::fill(line.begin() + start_offset, line.begin() + end_offset, working_command.value);
+        }
+        counters.bytes_moved += write_size;
     }
 
-    //Have done a read and have data
-    assert(active_buffer_valid);
-    assert(active_buffer_size >= vpu::defs::MEM_ACCESS_WIDTH || read_pointer >= working_command.source + working_command.length);
-    assert(active_buffer_address >= working_command.source);
-    assert(active_buffer_address + active_buffer_size < working_command.source + working_command.length + vpu::defs::MEM_ACCESS_WIDTH);
-
-    uint32_t start_offset = working_command.dest > write_pointer ? working_command.dest - write_pointer : 0;
-    uint32_t end_offset = 
-        (write_pointer + vpu::defs::MEM_ACCESS_WIDTH) >= (working_command.dest + working_command.length) ?
-            vpu::defs::MEM_ACCESS_WIDTH - ((write_pointer + vpu::defs::MEM_ACCESS_WIDTH) - (working_command.dest + working_command.length)) :
-            vpu::defs::MEM_ACCESS_WIDTH;
-    
-    //Non-standard case, overlaps at one or both end and need to fetch before writing
-    bool need_writeback_fetch = !(start_offset == 0 && end_offset == vpu::defs::MEM_ACCESS_WIDTH);
-
-    //Need to first fetch the data and do a selective copy to avoid overwriting outside the range
-    if (need_writeback_fetch && !fetched_writeback_data_valid) {
-        fetched_writeback_data_valid = true;
-        fetched_writeback_data = memory->read(write_pointer);
-        return; //Read takes cycle
-    }
-
-    uint32_t write_size = end_offset - start_offset;    
-
-    //Either no overlap, therefore fetch buffer overwritten, or overlap and only some data overwritten
-    std::copy(
-        active_buffer.begin(),
-        active_buffer.begin()+write_size,
-        fetched_writeback_data.begin()+start_offset
-    );
-
-    //Writeback data
-    memory->write(write_pointer, fetched_writeback_data);
-    //Buffer becomes invalid for new write pointer
-    fetched_writeback_data_valid = false;
-    //Write pointer always updates by full width
-    write_pointer += vpu::defs::MEM_ACCESS_WIDTH;
-    
-
-    //Update buffer
-    active_buffer_address += write_size;
-    active_buffer_size -= write_size;
-    std::rotate(active_buffer.begin(), active_buffer.begin()+write_size, active_buffer.end());
-
-    if (write_pointer >= working_command.dest + working_command.length) {
+    advance(progress, access, cycle);
+
+    if (access == WRITE && row_done(progress)) {
+        assert(progress.reads_count == 0 && progress.buffered == 0);
+        if (bulk) bulk_transfer();
         state = FINISHED;
-        active_buffer_valid = false;
-        assert(fetched_writeback_data_valid == false);
-        assert(active_buffer_size == 0);
-        assert(active_buffer_address == working_command.source + working_command.length);
     }
 }
 
-void DMA::set_cycle() {
-    assert(write_pointer < working_command.dest + working_command.length);
-    uint32_t remaining_length = working_command.length - (write_pointer - working_command.dest);
-    std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> data;
-    data.fill(working_command.value);
-    if (remaining_length >= vpu::defs::MEM_ACCESS_WIDTH && write_pointer >= working_command.dest){
-        memory->write(write_pointer, data);
+bool DMA::Channel::begin_cycle() {
+    if (finished_callback_valid) {
+        finished_callback();
+        finished_callback_valid = false;
+    }
+
+    if (state == IDLE) return false;
+    counters.busy_cycles++;
+    if (state == FINISHED) //Finish on the following cycle
+        state = IDLE; //may want to rework this to avoid a bubble
+    return true;
+}
+
+bool DMA::Channel::request_port() {
+    if (state != WORKING || vpu::defs::get_global_cycle() < work_cycle) return false;
+    if (descriptor_pending || next_access(progress, vpu::defs::get_global_cycle()) != NO_ACCESS)
+        return true;
+    counters.read_wait_cycles++;
+    return false;
+}
+
+void DMA::Channel::port_cycle() {
+    if (descriptor_pending) {
+        fetch_descriptor();
     } else {
-        //For now just do single line fetch/respond. Could queue this up properly later if needed
-        //Assumes single cycle memory latency and no contention
-
-        if (fetched_writeback_data_valid) {
-            // Writes and reads must be 64B aligned, therefore need to extend special cases of read, overwrite, writeback
-            // to when the range doesn't cover the middle.
-            uint32_t start_index = write_pointer >= working_command.dest ? 0 : write_pointer - working_command.dest;
-            std::copy(data.begin()+start_index,data.begin()+remaining_length, fetched_writeback_data.begin()+start_index);
-            memory->write(write_pointer, data);
-            fetched_writeback_data_valid = false;
+        uint32_t cycle = vpu::defs::get_global_cycle();
+        access(next_access(progress, cycle), cycle);
+    }
+
+    if (state == FINISHED && command_done()){
+        finished_callback = working_callback;
+        finished_callback_valid = true;
+    }
+}
+
+//The run ahead timing no longer holds once an access has to wait
+void DMA::Channel::port_denied() {
+    counters.wait_cycles++;
+    finish_valid = false;
+}
+
+uint32_t DMA::Channel::bulk_finish_cycle() const {
+    if (finish_valid) return finish_cycle;
+    Progress& ahead = finish_progress;
+    ahead = progress;
+    uint32_t cycle = vpu::defs::get_global_cycle();
+    uint64_t read_wait_cycles = counters.read_wait_cycles;
+    finish_accessed = false;
+    while (true) {
+        Access next = next_access(ahead, cycle);
+        if (next == NO_ACCESS) {
+            read_wait_cycles++;
         } else {
-            fetched_writeback_data = memory->read(write_pointer);
-            fetched_writeback_data_valid = true;
-            return;
+            //Stop short of the last write, ahead is then the state going into its cycle
+            if (next == WRITE && ahead.write_pointer + vpu::defs::MEM_ACCESS_WIDTH >= working_command.dest + working_command.length)
+                break;
+            advance(ahead, next, cycle);
+            finish_accessed = true;
+            finish_last_access = cycle;
         }
+        cycle++;
     }
-    write_pointer += vpu::defs::MEM_ACCESS_WIDTH;
-    if (write_pointer >= working_command.dest + working_command.length){
-        state = FINISHED;
-        assert(fetched_writeback_data_valid == false);
+    finish_valid = true;
+    finish_cycle = cycle;
+    finish_read_wait_cycles = read_wait_cycles;
+    return finish_cycle;
+}
+
+uint32_t DMA::Channel::next_event_cycle() const {
+    if (state == WORKING && bulk && !descriptor_pending && vpu::defs::get_global_cycle() >= work_cycle)
+        return bulk_finish_cycle();
+    if (state != IDLE || finished_callback_valid) return vpu::defs::get_global_cycle();
+    return NO_EVENT;
+}
+
+bool DMA::Channel::skip_cycles(uint32_t cycles) {
+    assert(!finished_callback_valid);
+    if (state == IDLE) return false;
+    uint32_t now = vpu::defs::get_global_cycle();
+    assert(state == WORKING && bulk && !descriptor_pending && now + cycles <= bulk_finish_cycle());
+    counters.busy_cycles += cycles;
+
+    //Skipping right up to the last write takes the state the run ahead ended with
+    if (now + cycles == finish_cycle) {
+        progress = finish_progress;
+        counters.read_wait_cycles = finish_read_wait_cycles;
+        return finish_accessed && finish_last_access >= now;
+    }
+
+    bool accessed = false;
+    for (uint32_t i = 0; i < cycles; i++) {
+        uint32_t cycle = vpu::defs::get_global_cycle() + i;
+        Access next = next_access(progress, cycle);
+        if (next == NO_ACCESS) {
+            counters.read_wait_cycles++;
+            continue;
+        }
+        advance(progress, next, cycle);
+        accessed = true;
     }
+    return accessed;
 }
 
 void DMA::run_cycle() {
-    if (finished_callback_valid) {
-        finished_callback();
-        finished_callback_valid = false;
+    HOST_TIMER(DMA);
+    bool busy = false;
+    for (auto& channel : channels)
+        busy |= channel.begin_cycle();
+    if (!busy) {
+        counters.idle_cycles++;
+        return;
     }
+    counters.busy_cycles++;
 
-    if (state == IDLE) return;
-    if (state == FINISHED){ //Finish on the following cycle
-        state = IDLE;
-        return; //may want to rework this to avoid a bubble
+    //Cannot start on first cycle, so a channel only asks for the port once it can use it
+    Channel* granted = nullptr;
+    uint32_t first = next_grant;
+    for (uint32_t i = 0; i < channels.size(); i++) {
+        uint32_t index = (first + i) % channels.size();
+        if (!channels[index].request_port()) continue;
+        if (granted) {
+            channels[index].port_denied();
+            continue;
+        }
+        granted = &channels[index];
+        next_grant = (index + 1) % channels.size();
     }
-    
-    //Cannot start on first cycle
-    if (vpu::defs::get_global_cycle() < work_cycle) return;
-    
-    switch(working_command.operation){
-        case COPY: copy_cycle(); break;
-        case SET : set_cycle(); break;
-        default:
-            std::cerr << "Invalid DMA operation ";
-            assert(false);
+    if (granted) granted->port_cycle();
+}
+
+//Channels sharing the port contend every cycle, only a lone bulk command can be skipped
+uint32_t DMA::next_event_cycle() const {
+    const Channel* active = nullptr;
+    for (auto& channel : channels) {
+        if (!channel.active()) continue;
+        if (active) return vpu::defs::get_global_cycle();
+        active = &channel;
     }
-    
-    if (state == FINISHED){
-        finished_callback = working_callback;
-        finished_callback_valid = true;
+    return active ? active->next_event_cycle() : NO_EVENT;
+}
+
+void DMA::skip_cycles(uint32_t cycles) {
+    bool busy = false;
+    for (uint32_t i = 0; i < channels.size(); i++) {
+        if (channels[i].state == Channel::IDLE) continue;
+        if (channels[i].skip_cycles(cycles))
+            next_grant = (i + 1) % channels.size();
+        busy = true;
+    }
+    if (busy)
+        counters.busy_cycles += cycles;
+    else
+        counters.idle_cycles += cycles;
+}
+
+void DMA::claim_writes(uint32_t address, uint32_t length) {
+    sync(address, length, true);
+    claim_address = address;
+    claim_length = length;
+}
+
+void DMA::register_counters(vpu::stats::Registry& registry) {
+    counters.read_wait_cycles = 0;
+    counters.bytes_moved = 0;
+    counters.descriptors = 0;
+    for (auto& channel : channels) {
+        counters.read_wait_cycles += channel.counters.read_wait_cycles;
+        counters.bytes_moved += channel.counters.bytes_moved;
+        counters.descriptors += channel.counters.descriptors;
+    }
+    registry.counter("dma", "busy_cycles", counters.busy_cycles, "Cycles with a command in progress");
+    registry.counter("dma", "idle_cycles", counters.idle_cycles, "Cycles without a command");
+    registry.counter("dma", "bytes_moved", counters.bytes_moved, "Bytes written to memory");
+    registry.counter("dma", "descriptors", counters.descriptors, "Chain descriptors read");
+    registry.counter("dma", "read_wait_cycles", counters.read_wait_cycles, "Channel cycles with nothing to access until read data returns");
+    registry.ratio("dma", "bytes_per_busy_cycle", counters.bytes_moved, counters.busy_cycles, "Bandwidth while a command is in progress");
+    if (channels.size() == 1) return;
+    for (uint32_t i = 0; i < channels.size(); i++) {
+        std::string group = "dma_channel" + std::to_string(i);
+        registry.counter(group, "busy_cycles", channels[i].counters.busy_cycles, "Cycles with a command in progress");
+        registry.counter(group, "wait_cycles", channels[i].counters.wait_cycles, "Cycles the memory port was granted to another channel");
+        registry.counter(group, "read_wait_cycles", channels[i].counters.read_wait_cycles, "Cycles with nothing to access until read data returns");
+        registry.counter(group, "bytes_moved", channels[i].counters.bytes_moved, "Bytes written to memory");
     }
 }
 
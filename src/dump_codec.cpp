@@ -0,0 +1,113 @@
+#include "dump_codec.h"
+#include <algorithm>
+#include <cstring>
+
+namespace vpu::dump {
+
+constexpr size_t MAX_LITERAL = 128;
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t MAX_MATCH = 127 + MIN_MATCH;
+constexpr size_t MAX_DISTANCE = 0xFFFF;
+constexpr uint32_t HASH_BITS = 14;
+
+bool all_zero(std::span<const uint8_t> data) {
+    uint64_t acc = 0;
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data.data() + i, 8);
+        acc |= word;
+    }
+    for (; i < data.size(); i++) acc |= data[i];
+    return acc == 0;
+}
+
+static uint32_t hash4(const uint8_t* p) {
+    uint32_t v;
+    std::memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void flush_literals(std::span<const uint8_t> in, size_t start, size_t end, std::vector<uint8_t>& out) {
+    while (start < end) {
+        size_t count = std::min(end - start, MAX_LITERAL);
+        out.push_back(count - 1);
+        out.insert(out.end(), in.begin() + start, in.begin() + start + count);
+        start += count;
+    }
+}
+
+void compress(std::span<const uint8_t> in, std::vector<uint8_t>& out) {
+    //Greedy single-probe LZ, last position seen for each 4-byte hash
+    std::vector<uint32_t> table(1 << HASH_BITS, UINT32_MAX);
+    size_t literal_start = 0;
+    size_t pos = 0;
+    while (pos + MIN_MATCH <= in.size()) {
+        uint32_t h = hash4(&in[pos]);
+        uint32_t candidate = table[h];
+        table[h] = pos;
+        if (candidate == UINT32_MAX || pos - candidate > MAX_DISTANCE
+            || std::memcmp(&in[candidate], &in[pos], MIN_MATCH) != 0) {
+            pos++;
+            continue;
+        }
+
+        size_t length = MIN_MATCH;
+        size_t limit = std::min(MAX_MATCH, in.size() - pos);
+        while (length < limit && in[candidate + length] == in[pos + length]) length++;
+
+        flush_literals(in, literal_start, pos, out);
+        size_t distance = pos - candidate;
+        out.push_back(0x80 | (length - MIN_MATCH));
+        out.push_back(distance & 0xFF);
+        out.push_back(distance >> 8);
+        pos += length;
+        literal_start = pos;
+    }
+    flush_literals(in, literal_start, in.size(), out);
+}
+
+bool decompress(std::span<const uint8_t> in, std::span<uint8_t> out) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < in.size()) {
+        uint8_t control = in[ip++];
+        if (!(control & 0x80)) {
+            size_t count = control + 1;
+            if (ip + count > in.size() || op + count > out.size()) return false;
+            std::memcpy(&out[op], &in[ip], count);
+            ip += count;
+            op += count;
+        } else {
+            size_t length = (control & 0x7F) + MIN_MATCH;
+            if (ip + 2 > in.size()) return false;
+            size_t distance = in[ip] | (in[ip+1] << 8);
+            ip += 2;
+            if (distance == 0 || distance > op || op + length > out.size()) return false;
+            //Byte at a time, matches may overlap their own output
+            for (size_t i = 0; i < length; i++, op++)
+                out[op] = out[op - distance];
+        }
+    }
+    return op == out.size();
+}
+
+void encode_page(uint32_t index, std::span<const uint8_t> data, std::vector<uint8_t>& out) {
+    if (all_zero(data)) return;
+
+    size_t header_pos = out.size();
+    out.resize(out.size() + sizeof(PageHeader));
+    compress(data, out);
+
+    PageHeader header{index, 0, (uint32_t)(out.size() - header_pos - sizeof(PageHeader))};
+    //Incompressible pages are stored as they are
+    if (header.length >= data.size()) {
+        out.resize(header_pos + sizeof(PageHeader));
+        out.insert(out.end(), data.begin(), data.end());
+        header.flags = PAGE_RAW;
+        header.length = data.size();
+    }
+    std::memcpy(&out[header_pos], &header, sizeof(header));
+}
+
+}
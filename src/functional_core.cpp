@@ -0,0 +1,372 @@
+#include <cstdlib>
+#include <iostream>
+#include <assert.h>
+
+#include "defs_pkg.h"
+#include "functional_core.h"
+
+#ifndef __GNUC__
+#error "FunctionalCore::run dispatches with computed goto, which needs GCC or Clang"
+#endif
+
+namespace vpu {
+
+FunctionalCore::FunctionalCore(
+    std::unique_ptr<vpu::mem::Memory>& memory,
+    DMA& dma,
+    Blitter& blitter
+) :
+    memory(memory),
+    dma(dma),
+    blitter(blitter)
+{
+    registers.fill(0);
+    flags.fill(0);
+    memory->add_write_watcher([this](uint32_t page) { invalidate_page(page); });
+}
+
+uint32_t FunctionalCore::get_register(vpu::defs::Register reg) {
+    return registers[reg];
+}
+
+uint64_t FunctionalCore::retired_instructions() {
+    return retired;
+}
+
+void FunctionalCore::register_counters(vpu::stats::Registry& registry) {
+    registry.counter("functional", "retired_instructions", retired, "Instructions executed");
+}
+
+FunctionalCore::Op FunctionalCore::translate_instruction(uint32_t instruction) {
+    auto op = [this](Handler handler, uint32_t operand=0, uint8_t reg0=0, uint8_t reg1=0) {
+        return Op{handlers[(size_t)handler], operand, reg0, reg1};
+    };
+    auto reg = [instruction](int index) {
+        return (uint8_t)vpu::defs::get_register(instruction,index);
+    };
+    if (instruction == vpu::defs::SEGMENT_END)
+        return op(Handler::SEGMENT_END);
+    switch (vpu::defs::get_opcode(instruction)) {
+        case vpu::defs::NOP:           return op(Handler::NOP);
+        case vpu::defs::HLT:           return op(Handler::HLT);
+        case vpu::defs::JMP_L:         return op(Handler::JMP_L, vpu::defs::get_label(instruction));
+        case vpu::defs::BRA_L:         return op(Handler::BRA_L, vpu::defs::get_label(instruction));
+        case vpu::defs::MOV_I24:       return op(Handler::MOV_I24, vpu::defs::get_u24(instruction));
+        case vpu::defs::ADD_I24:       return op(Handler::ADD_I24, vpu::defs::get_u24(instruction));
+        case vpu::defs::ASR_I24:       return op(Handler::ASR_I24, vpu::defs::get_u24(instruction));
+        case vpu::defs::LSR_I24:       return op(Handler::LSR_I24, vpu::defs::get_u24(instruction));
+        case vpu::defs::LSL_I24:       return op(Handler::LSL_I24, vpu::defs::get_u24(instruction));
+        case vpu::defs::ASR_R:         return op(Handler::ASR_R, 0, reg(0));
+        case vpu::defs::LSR_R:         return op(Handler::LSR_R, 0, reg(0));
+        case vpu::defs::LSL_R:         return op(Handler::LSL_R, 0, reg(0));
+        case vpu::defs::CMP_R:         return op(Handler::CMP_R, 0, reg(0));
+        case vpu::defs::CMP_R_R:       return op(Handler::CMP_R_R, 0, reg(0), reg(1));
+        case vpu::defs::MOV_R_I16:     return op(Handler::MOV_R_I16, vpu::defs::get_u16(instruction), reg(0));
+        case vpu::defs::MOV_R_R:       return op(Handler::MOV_R_R, 0, reg(0), reg(1));
+        //Pipes
+        case vpu::defs::P_SCH_FNC:     return op(Handler::NOP); //Pipes always complete immediately
+        case vpu::defs::P_DMA_DST_R:   return op(Handler::DMA_DST_R, 0, reg(0));
+        case vpu::defs::P_DMA_SRC_R:   return op(Handler::DMA_SRC_R, 0, reg(0));
+        case vpu::defs::P_DMA_LEN_R:   return op(Handler::DMA_LEN_R, 0, reg(0));
+        case vpu::defs::P_DMA_SET_R:   return op(Handler::DMA_SET_R, 0, reg(0));
+        case vpu::defs::P_DMA_CPY:     return op(Handler::DMA_CPY);
+        case vpu::defs::P_BLI_COL_R:   return op(Handler::BLI_COL_R, 0, reg(0));
+        case vpu::defs::P_BLI_CLR:     return op(Handler::BLI_CLR);
+        case vpu::defs::P_BLI_PIX_R_R: return op(Handler::BLI_PIX_R_R, 0, reg(0), reg(1));
+        //Only an error if it is reached, the block may be left before it
+        default:                       return op(Handler::INVALID, instruction);
+    }
+}
+
+FunctionalCore::Block* FunctionalCore::translate(uint32_t pc) {
+    auto block = std::make_unique<Block>();
+    block->start = pc;
+    block->length = 0;
+    while (true) {
+        uint32_t instruction = memory->read_word(pc);
+        Op op = translate_instruction(instruction);
+        block->length++;
+        block->end = pc;
+        const void* handler = op.handler;
+        //Fuse a compare into the branch that follows it
+        if (handler == handlers[(size_t)Handler::BRA_L] && !block->ops.empty()) {
+            Op& previous = block->ops.back();
+            if (previous.handler == handlers[(size_t)Handler::CMP_R]) {
+                previous.handler = handlers[(size_t)Handler::CMP_R_BRA_L];
+                previous.operand = op.operand;
+                break;
+            }
+            if (previous.handler == handlers[(size_t)Handler::CMP_R_R]) {
+                previous.handler = handlers[(size_t)Handler::CMP_R_R_BRA_L];
+                previous.operand = op.operand;
+                break;
+            }
+        }
+        block->ops.push_back(op);
+        if (handler == handlers[(size_t)Handler::JMP_L] || handler == handlers[(size_t)Handler::BRA_L] ||
+            handler == handlers[(size_t)Handler::HLT] || handler == handlers[(size_t)Handler::SEGMENT_END] ||
+            handler == handlers[(size_t)Handler::INVALID])
+            break;
+        if (block->length == MAX_BLOCK_LENGTH || pc + 4 >= vpu::defs::MEM_SIZE) {
+            //Continue into the next block at the following address
+            block->ops.push_back({handlers[(size_t)Handler::FALLTHROUGH], 0, 0, 0});
+            break;
+        }
+        pc += 4;
+    }
+
+    for (uint32_t page = block->start >> vpu::mem::PAGE_BITS; page <= block->end >> vpu::mem::PAGE_BITS; page++) {
+        page_blocks[page].push_back(block->start);
+        memory->watch_page(page);
+    }
+    return (blocks[block->start] = std::move(block)).get();
+}
+
+FunctionalCore::Block* FunctionalCore::find_block(uint32_t pc) {
+    auto found = blocks.find(pc);
+    if (found != blocks.end())
+        return found->second.get();
+    return translate(pc);
+}
+
+void FunctionalCore::invalidate_page(uint32_t page) {
+    auto found = page_blocks.find(page);
+    if (found == page_blocks.end()) return;
+    for (uint32_t start : found->second) {
+        auto block = blocks.find(start);
+        //Blocks covering several pages may already be gone
+        if (block == blocks.end()) continue;
+        stale_blocks.push_back(std::move(block->second));
+        blocks.erase(block);
+    }
+    page_blocks.erase(found);
+    //Invalidation is rare, so rather than tracking who links to what every link is dropped
+    for (auto& [start, block] : blocks) {
+        block->taken = nullptr;
+        block->fallthrough = nullptr;
+    }
+    blocks_invalidated = true;
+}
+
+void FunctionalCore::run() {
+    handlers[(size_t)Handler::NOP]           = &&op_nop;
+    handlers[(size_t)Handler::HLT]           = &&op_hlt;
+    handlers[(size_t)Handler::SEGMENT_END]   = &&op_segment_end;
+    handlers[(size_t)Handler::INVALID]       = &&op_invalid;
+    handlers[(size_t)Handler::FALLTHROUGH]   = &&op_fallthrough;
+    handlers[(size_t)Handler::JMP_L]         = &&op_jmp_l;
+    handlers[(size_t)Handler::BRA_L]         = &&op_bra_l;
+    handlers[(size_t)Handler::CMP_R_BRA_L]   = &&op_cmp_r_bra_l;
+    handlers[(size_t)Handler::CMP_R_R_BRA_L] = &&op_cmp_r_r_bra_l;
+    handlers[(size_t)Handler::MOV_I24]       = &&op_mov_i24;
+    handlers[(size_t)Handler::ADD_I24]       = &&op_add_i24;
+    handlers[(size_t)Handler::ASR_I24]       = &&op_asr_i24;
+    handlers[(size_t)Handler::LSR_I24]       = &&op_lsr_i24;
+    handlers[(size_t)Handler::LSL_I24]       = &&op_lsl_i24;
+    handlers[(size_t)Handler::ASR_R]         = &&op_asr_r;
+    handlers[(size_t)Handler::LSR_R]         = &&op_lsr_r;
+    handlers[(size_t)Handler::LSL_R]         = &&op_lsl_r;
+    handlers[(size_t)Handler::CMP_R]         = &&op_cmp_r;
+    handlers[(size_t)Handler::CMP_R_R]       = &&op_cmp_r_r;
+    handlers[(size_t)Handler::MOV_R_I16]     = &&op_mov_r_i16;
+    handlers[(size_t)Handler::MOV_R_R]       = &&op_mov_r_r;
+    handlers[(size_t)Handler::DMA_DST_R]     = &&op_dma_dst_r;
+    handlers[(size_t)Handler::DMA_SRC_R]     = &&op_dma_src_r;
+    handlers[(size_t)Handler::DMA_LEN_R]     = &&op_dma_len_r;
+    handlers[(size_t)Handler::DMA_SET_R]     = &&op_dma_set_r;
+    handlers[(size_t)Handler::DMA_CPY]       = &&op_dma_cpy;
+    handlers[(size_t)Handler::BLI_COL_R]     = &&op_bli_col_r;
+    handlers[(size_t)Handler::BLI_PIX_R_R]   = &&op_bli_pix_r_r;
+    handlers[(size_t)Handler::BLI_CLR]       = &&op_bli_clr;
+
+    uint32_t* r = registers.data();
+    Block* block = find_block(registers[vpu::defs::PC]);
+    const Op* entry = block->ops.data();
+    uint32_t pc;
+    int32_t signed_temp;
+    uint32_t unsigned_temp;
+
+//Writes to the PC register are ignored, as in the pipeline
+#define WRITE(reg, value) do { if ((reg) != vpu::defs::PC) r[reg] = (value); } while (0)
+#define DISPATCH() goto *entry->handler
+#define NEXT() do { entry++; DISPATCH(); } while (0)
+//Leave the block through one of its links, looking the successor up the first time
+#define CHAIN(link, target) do { \
+        retired += block->length; \
+        if (!block->link) block->link = find_block(target); \
+        block = block->link; \
+        entry = block->ops.data(); \
+        DISPATCH(); \
+    } while (0)
+//A pipe command may have written over translated code, including this block. Ops before the
+//terminator map one to one onto instructions, so the block is left at the next address.
+#define CHECK_INVALIDATED() do { \
+        if (blocks_invalidated) { \
+            pc = block->start + 4 * (uint32_t)(entry - block->ops.data()); \
+            retired += (entry - block->ops.data()) + 1; \
+            blocks_invalidated = false; \
+            block = find_block(pc + 4); \
+            stale_blocks.clear(); \
+            entry = block->ops.data(); \
+            DISPATCH(); \
+        } \
+    } while (0)
+
+    DISPATCH();
+
+op_fallthrough:
+    //Length is only counted up to the last real instruction
+    CHAIN(fallthrough, block->end + 4);
+
+op_invalid:
+    std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(vpu::defs::get_opcode(entry->operand));
+    std::cerr << " at address " << std::hex << block->start + 4 * (uint32_t)(entry - block->ops.data()) << std::endl;
+    assert(false);
+    exit(1);
+
+op_nop:
+    NEXT();
+
+op_hlt:
+    retired += block->length;
+    registers[vpu::defs::PC] = block->end;
+    return;
+
+op_segment_end:
+    //The pipeline has already fetched past the end marker when decode halts
+    retired += block->length - 1;
+    registers[vpu::defs::PC] = block->end + 8;
+    return;
+
+op_jmp_l:
+    CHAIN(taken, entry->operand);
+
+op_bra_l:
+    if (flags[vpu::defs::C]) CHAIN(taken, entry->operand);
+    CHAIN(fallthrough, block->end + 4);
+
+op_cmp_r_bra_l:
+    flags[vpu::defs::C] = r[entry->reg0] == 0;
+    if (flags[vpu::defs::C]) CHAIN(taken, entry->operand);
+    CHAIN(fallthrough, block->end + 4);
+
+op_cmp_r_r_bra_l:
+    flags[vpu::defs::C] = r[entry->reg1] == r[entry->reg0];
+    if (flags[vpu::defs::C]) CHAIN(taken, entry->operand);
+    CHAIN(fallthrough, block->end + 4);
+
+op_mov_i24:
+    r[vpu::defs::ACC] = entry->operand;
+    NEXT();
+
+op_add_i24:
+    r[vpu::defs::ACC] = entry->operand + r[vpu::defs::ACC];
+    NEXT();
+
+op_asr_i24:
+    signed_temp = (int32_t)r[vpu::defs::ACC];
+    signed_temp >>= entry->operand;
+    r[vpu::defs::ACC] = signed_temp;
+    NEXT();
+
+op_lsr_i24:
+    unsigned_temp = (int32_t)r[vpu::defs::ACC];
+    unsigned_temp >>= entry->operand;
+    r[vpu::defs::ACC] = unsigned_temp;
+    NEXT();
+
+op_lsl_i24:
+    unsigned_temp = (int32_t)r[vpu::defs::ACC];
+    unsigned_temp <<= entry->operand;
+    r[vpu::defs::ACC] = unsigned_temp;
+    NEXT();
+
+op_asr_r:
+    signed_temp = (int32_t)r[vpu::defs::ACC];
+    signed_temp >>= r[entry->reg0];
+    r[vpu::defs::ACC] = signed_temp;
+    NEXT();
+
+op_lsr_r:
+    unsigned_temp = (int32_t)r[vpu::defs::ACC];
+    unsigned_temp >>= r[entry->reg0];
+    r[vpu::defs::ACC] = unsigned_temp;
+    NEXT();
+
+op_lsl_r:
+    unsigned_temp = (int32_t)r[vpu::defs::ACC];
+    unsigned_temp <<= r[entry->reg0];
+    r[vpu::defs::ACC] = unsigned_temp;
+    NEXT();
+
+op_cmp_r:
+    flags[vpu::defs::C] = r[entry->reg0] == 0;
+    NEXT();
+
+op_cmp_r_r:
+    flags[vpu::defs::C] = r[entry->reg1] == r[entry->reg0];
+    NEXT();
+
+op_mov_r_i16:
+    WRITE(entry->reg0, entry->operand);
+    NEXT();
+
+op_mov_r_r:
+    WRITE(entry->reg0, r[entry->reg1]);
+    NEXT();
+
+op_dma_dst_r:
+    dma_frontend_state.dest = r[entry->reg0];
+    NEXT();
+
+op_dma_src_r:
+    dma_frontend_state.source = r[entry->reg0];
+    NEXT();
+
+op_dma_len_r:
+    dma_frontend_state.length = r[entry->reg0];
+    NEXT();
+
+op_dma_set_r:
+    dma_frontend_state.value = r[entry->reg0];
+    dma_frontend_state.operation = DMA::SET;
+    dma.execute(dma_frontend_state);
+    dma_frontend_state.operation = DMA::NONE;
+    CHECK_INVALIDATED();
+    NEXT();
+
+op_dma_cpy:
+    dma_frontend_state.operation = DMA::COPY;
+    dma.execute(dma_frontend_state);
+    dma_frontend_state.operation = DMA::NONE;
+    CHECK_INVALIDATED();
+    NEXT();
+
+op_bli_col_r:
+    blitter_frontend_state.colour = (r[entry->reg0] << 8) | 0xFF; //Value in RGB, but colours are RGBA
+    NEXT();
+
+op_bli_pix_r_r:
+    blitter_frontend_state.xpos = r[entry->reg0];
+    blitter_frontend_state.ypos = r[entry->reg1];
+    blitter_frontend_state.operation = Blitter::PIXEL;
+    blitter.execute(blitter_frontend_state);
+    blitter_frontend_state.operation = Blitter::NONE;
+    CHECK_INVALIDATED();
+    NEXT();
+
+op_bli_clr:
+    blitter_frontend_state.operation = Blitter::CLEAR;
+    blitter.execute(blitter_frontend_state);
+    blitter_frontend_state.operation = Blitter::NONE;
+    CHECK_INVALIDATED();
+    NEXT();
+
+#undef WRITE
+#undef DISPATCH
+#undef NEXT
+#undef CHAIN
+#undef CHECK_INVALIDATED
+}
+
+}
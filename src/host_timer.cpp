@@ -0,0 +1,41 @@
+#include "host_timer.h"
+#include <chrono>
+#include <iomanip>
+
+namespace vpu::host_timer {
+
+static const std::array<const char*,SECTION_COUNT> section_names = {
+    "core", "  fetch", "  decode", "  execute", "  memory", "  writeback", "scheduler", "dma", "blitter"
+};
+
+static uint64_t start_ticks;
+static std::chrono::steady_clock::time_point start_time;
+
+void start() {
+    start_ticks = now();
+    start_time = std::chrono::steady_clock::now();
+}
+
+void report(std::ostream& out, uint64_t cycles) {
+    uint64_t elapsed_ticks = now() - start_ticks;
+    double elapsed_ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start_time).count();
+    double ns_per_tick = elapsed_ticks ? elapsed_ns / elapsed_ticks : 0.0;
+
+    std::ios_base::fmtflags saved_flags = out.flags();
+    std::streamsize saved_precision = out.precision();
+    out << "---------- Host time per simulated cycle ----------\n";
+    out << std::fixed << std::setprecision(2);
+    for (int section = 0; section < SECTION_COUNT; section++) {
+        double ns = ticks[section] * ns_per_tick;
+        out << std::left << std::setw(16) << section_names[section] << std::right;
+        out << std::setw(12) << (cycles ? ns / cycles : 0.0) << " ns";
+        out << std::setw(10) << (elapsed_ns ? 100.0 * ns / elapsed_ns : 0.0) << " %\n";
+    }
+    out << std::left << std::setw(16) << "total" << std::right;
+    out << std::setw(12) << (cycles ? elapsed_ns / cycles : 0.0) << " ns\n";
+    out << "---------------------------------------------------" << std::endl;
+    out.flags(saved_flags);
+    out.precision(saved_precision);
+}
+
+}
@@ -1,7 +1,12 @@
 #include <iostream>
+#include <assert.h>
 #include <memory>
 #include <iomanip>
 #include <cstdlib>
+#include <algorithm>
+#include <span>
+#include <thread>
+#include <vector>
 
 #include "memory.h"
 #include "config.h"
@@ -9,6 +14,12 @@
 #include "manager_core.h"
 #include "scheduler.h"
 #include "dma.h"
+#include "dump_codec.h"
+#include "functional_core.h"
+#include "instrumentation.h"
+#include "counters.h"
+#include "profiler.h"
+#include "host_timer.h"
 
 #ifdef RPC
 #include "rpc_interface.h"
@@ -17,13 +28,17 @@
 
 namespace vpu {
 
+//Policy is one of vpu::instrument, picked in main from the config
+template <typename Policy>
 class System {
     config::Config config;
     std::unique_ptr<mem::Memory> memory;
     DMA dma;
     Blitter blitter;
-    ManagerCore core;
+    ManagerCore<Policy> core;
     Scheduler scheduler;
+    //Only created for --functional
+    std::unique_ptr<FunctionalCore> functional;
 
     #ifdef RPC
     std::unique_ptr<SimulatorRPCInterface> server_interface;
@@ -36,17 +51,94 @@ class System {
         vpu::mem::MemorySnooper::copy_file_in(memory, config.input_file);
     };
 
+    //Program words from address 0 up to the region end marker
+    std::vector<uint32_t> read_program() {
+        std::vector<uint32_t> program;
+        for (uint32_t addr = 0; addr < vpu::defs::MEM_SIZE; addr += 4) {
+            uint32_t data = memory->read_word(addr);
+            if (data == vpu::defs::SEGMENT_END) break;
+            program.push_back(data);
+        }
+        return program;
+    }
+
     void dump_program(){
-        for (int i=0; true; i++) {
-            uint32_t data = memory->read_word(i*4);
-            //Region end marker
-            if (data == 0xFFFFFFFF) break;
-            vpu::defs::Opcode opcode = vpu::defs::get_opcode(data);
+        auto program = read_program();
+        for (size_t i = 0; i < program.size(); i++) {
+            vpu::defs::Opcode opcode = vpu::defs::get_opcode(program[i]);
             std::cout << std::setfill('0') << std::setw(8) << std::hex << i*4;
             std::cout << " " << vpu::defs::opcode_to_string(opcode) << std::endl;
         }
     }
 
+    void dump_profile() {
+        auto profiler = core.get_profiler();
+        assert(profiler);
+        //Read after the run, so the listing shows any code the program rewrote
+        auto program = read_program();
+        if (config.profile != "") {
+            std::cout << "Dumping profile to " << config.profile << std::endl;
+            std::ofstream dump(config.profile, std::ios::out);
+            profiler->write_table(dump, program);
+        }
+        if (config.profile_folded != "") {
+            std::cout << "Dumping folded profile to " << config.profile_folded << std::endl;
+            std::ofstream dump(config.profile_folded, std::ios::out);
+            profiler->write_folded(dump, program);
+        }
+    }
+
+    //Visit a memory range a page at a time, so unallocated pages are never materialised
+    template <typename F>
+    void for_each_mem_chunk(uint32_t address, uint32_t length, F visit) {
+        uint64_t end = (uint64_t)address + length;
+        for (uint64_t addr = address; addr < end;) {
+            auto page = mem::MemorySnooper::get_page(memory, addr >> mem::PAGE_BITS);
+            uint32_t offset = addr & mem::PAGE_MASK;
+            size_t chunk = std::min<uint64_t>(mem::PAGE_SIZE - offset, end - addr);
+            visit(page.subspan(offset, chunk));
+            addr += chunk;
+        }
+    }
+
+    //64-bit FNV-1a
+    static uint64_t hash_update(uint64_t hash, std::span<const uint8_t> data) {
+        for (uint8_t byte : data) {
+            hash ^= byte;
+            hash *= 0x100000001B3;
+        }
+        return hash;
+    }
+    static constexpr uint64_t HASH_INIT = 0xCBF29CE484222325;
+
+    //Sparse dump skipping zero pages, encoded in parallel with one contiguous slice of pages per worker
+    void dump_mem_compressed(std::ofstream& dump) {
+        dump::SparseHeader header{dump::SPARSE_MAGIC, dump::SPARSE_VERSION, mem::PAGE_SIZE, mem::PAGE_COUNT, vpu::defs::MEM_SIZE};
+        dump.write((const char*)&header, sizeof(header));
+
+        //Threads are started once, each encodes its own slice into its own buffer
+        uint32_t workers = std::max(1u, std::min(std::thread::hardware_concurrency(), mem::PAGE_COUNT));
+        uint32_t pages_per_worker = (mem::PAGE_COUNT + workers - 1) / workers;
+        std::vector<std::vector<uint8_t>> encoded(workers);
+        std::vector<std::thread> threads;
+        for (uint32_t w = 0; w < workers; w++) {
+            uint32_t first = std::min(w * pages_per_worker, mem::PAGE_COUNT);
+            uint32_t last = std::min(first + pages_per_worker, mem::PAGE_COUNT);
+            threads.emplace_back([this, &encoded, w, first, last]() {
+                for (uint32_t page = first; page < last; page++) {
+                    if (!mem::MemorySnooper::page_allocated(memory, page)) continue;
+                    uint32_t page_addr = page << mem::PAGE_BITS;
+                    size_t length = std::min<size_t>(mem::PAGE_SIZE, vpu::defs::MEM_SIZE - page_addr);
+                    dump::encode_page(page, mem::MemorySnooper::get_page(memory, page).first(length), encoded[w]);
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+        //Written in worker order to keep pages sorted
+        for (auto& buffer : encoded)
+            dump.write((const char*)buffer.data(), buffer.size());
+    }
+
     void dump_mem() {
         fs::path dump_path = config.dump_mem;
         if (fs::exists(dump_path) && fs::is_directory(dump_path)) {
@@ -54,10 +146,39 @@ class System {
             exit(1);
         }
 
+        //Without explicit ranges the whole memory is dumped
+        std::vector<config::Config::MemRange> ranges = config.dump_mem_ranges;
+        if (ranges.empty())
+            ranges.push_back({0, vpu::defs::MEM_SIZE});
+
+        if (config.dump_mem_digest) {
+            //One line per range: address length hash
+            std::cout << "Dumping memory digest to " << config.dump_mem << std::endl;
+            std::ofstream dump(dump_path, std::ios::out);
+            for (auto& range : ranges) {
+                uint64_t hash = HASH_INIT;
+                for_each_mem_chunk(range.address, range.length, [&](std::span<const uint8_t> chunk) {
+                    hash = hash_update(hash, chunk);
+                });
+                dump << std::hex << std::setfill('0') << "0x" << std::setw(8) << range.address;
+                dump << " 0x" << std::setw(8) << range.length << " " << std::setw(16) << hash << "\n";
+            }
+            return;
+        }
+
         std::cout << "Dumping memory state to " << config.dump_mem << std::endl;
         std::ofstream dump(dump_path, std::ios::out | std::ios::binary);
-        auto& data = mem::MemorySnooper::get_data(memory);
-        dump.write((char*)&data[0], data.size());
+        if (config.dump_mem_compress) {
+            dump_mem_compressed(dump);
+            return;
+        }
+
+        //Ranges are written back to back in the order given
+        for (auto& range : ranges) {
+            for_each_mem_chunk(range.address, range.length, [&](std::span<const uint8_t> chunk) {
+                dump.write((const char*)chunk.data(), chunk.size());
+            });
+        }
     }
 
     void dump_regs() {
@@ -71,36 +192,98 @@ class System {
         std::ofstream dump(dump_path, std::ios::out);
         for (uint8_t r = 0; r < vpu::defs::REGISTER_COUNT; r++) {
             dump << vpu::defs::register_to_string((vpu::defs::Register)r) << " ";
-            dump << vpu::ManagerCoreSnooper::get_register(core,(vpu::defs::Register)r);
+            if (functional)
+                dump << functional->get_register((vpu::defs::Register)r);
+            else
+                dump << vpu::ManagerCoreSnooper::get_register(core,(vpu::defs::Register)r);
             dump << "\n";
         }
     }
 
+    void dump_stats() {
+        stats::Registry registry;
+        if (functional) {
+            functional->register_counters(registry);
+        } else {
+            core.register_counters(registry);
+            scheduler.register_counters(registry);
+        }
+        dma.register_counters(registry);
+        blitter.register_counters(registry);
+
+        if (config.stats)
+            registry.print_text(std::cout);
+
+        if (config.stats_json != "") {
+            std::cout << "Dumping statistics to " << config.stats_json << std::endl;
+            std::ofstream dump(config.stats_json, std::ios::out);
+            registry.print_json(dump);
+        }
+    }
+
     void run_cycle() {
-        core.run_cycle();
-        scheduler.run_cycle();
-        dma.run_cycle();
-        blitter.run_cycle();
+        //Instrumentation needs every component to run every cycle
+        if constexpr (Policy::STATUS || Policy::PROFILE) {
+            core.run_cycle();
+            scheduler.run_cycle();
+            dma.run_cycle();
+            blitter.run_cycle();
+        } else {
+            //A core blocked on the scheduler, such as on a fence while the DMA works, only needs
+            //its bookkeeping. The core runs first so nothing can unblock it earlier in the cycle.
+            if (core.next_event_cycle() == NO_EVENT) {
+                skip_idle_cycles();
+                core.skip_cycles(1);
+            } else {
+                core.run_cycle();
+            }
+            scheduler.run_cycle();
+            dma.run_cycle();
+            blitter.run_cycle();
+        }
+    }
+
+    //With the core blocked and nothing due in the other components either, jump the clock to
+    //the first cycle something is. This gives the same state as running every cycle in between.
+    void skip_idle_cycles() {
+        uint32_t cycle = vpu::defs::get_global_cycle();
+        uint32_t next = std::min({
+            scheduler.next_event_cycle(),
+            dma.next_event_cycle(),
+            blitter.next_event_cycle()
+        });
+        //Without any event nothing can ever change, leave the hang to the normal loop
+        if (next == NO_EVENT || next <= cycle) return;
+
+        uint32_t cycles = next - cycle;
+        core.skip_cycles(cycles);
+        scheduler.skip_cycles(cycles);
+        dma.skip_cycles(cycles);
+        blitter.skip_cycles(cycles);
+        for (uint32_t i = 0; i < cycles; i++)
+            vpu::defs::increment_global_cycle();
     }
 
 public:
     void run_program() {
-        uint32_t step_count = 1;
-        core.print_status_start();
-        while (!core.check_has_halted()) {
-            run_cycle();
-            vpu::defs::increment_global_cycle();
+#ifdef HOST_TIMERS
+        vpu::host_timer::start();
+#endif
+        if (functional) {
+            functional->run();
+        } else {
+            run_pipeline();
+        }
+#ifdef HOST_TIMERS
+        vpu::host_timer::report(std::cout, vpu::defs::get_global_cycle());
+#endif
 
-            if (step_count > 0) step_count--;
-            core.print_status(vpu::defs::get_global_cycle());
-            if (config.step && step_count == 0){
-                std::string step_count_str; 
-                std::getline(std::cin, step_count_str);
-                if (step_count_str.length() == 0)
-                    step_count = 0;
-                else
-                    step_count = std::stoi(step_count_str);
-            }
+        if (config.stats || config.stats_json != "") {
+            dump_stats();
+        }
+
+        if (config.profile != "" || config.profile_folded != "") {
+            dump_profile();
         }
 
         if (config.dump_regs != "") {
@@ -112,18 +295,56 @@ public:
         }
     }
 
+    void run_pipeline() {
+        uint32_t step_count = 1;
+        core.print_status_start();
+        while (!core.check_has_halted()) {
+            run_cycle();
+            vpu::defs::increment_global_cycle();
+
+            if constexpr (Policy::STATUS) {
+                if (step_count > 0) step_count--;
+                core.print_status(vpu::defs::get_global_cycle());
+                if (config.step && step_count == 0){
+                    core.flush_status();
+                    std::string step_count_str; 
+                    std::getline(std::cin, step_count_str);
+                    if (step_count_str.length() == 0)
+                        step_count = 0;
+                    else
+                        step_count = std::stoi(step_count_str);
+                }
+            }
+        }
+        //A transfer still running when the core halts is left as far as it got
+        dma.sync(0, vpu::defs::MEM_SIZE, false);
+        core.flush_status();
+    }
+
+    static_assert(config::MAX_DMA_READS <= DMA::MAX_READS, "DMA channels hold fewer reads than the config allows");
+
     System(config::Config config) :
         config(config),
-        memory(std::make_unique<vpu::mem::Memory>()),
-        dma(memory),
-        blitter(memory),
+        memory(std::make_unique<vpu::mem::Memory>(config.memory_backend)),
+        //Tracing and the inspector show every DMA line as it is written, otherwise rows are
+        //moved in one go unless something else reaches them first
+        dma(memory, Policy::STATUS
+#ifdef RPC
+            || config.inspector
+#endif
+            , config.dma_channels, config.dma_latency, config.dma_reads
+        ),
+        blitter(memory, dma),
         scheduler(dma, blitter),
-        core(config, memory, scheduler)
+        core(this->config, memory, scheduler, dma)
 #ifdef RPC
         ,server_interface(std::make_unique<rpc::ServerInterface>(memory))
         ,server_wrapper(config.inspector, server_interface)
 #endif
     {
+        if (config.functional)
+            functional = std::make_unique<FunctionalCore>(memory, dma, blitter);
+
         initialise_memory_state();
 
         if (config.dump) {
@@ -134,6 +355,12 @@ public:
 
 }
 
+template <typename Policy>
+void run(vpu::config::Config& config) {
+    vpu::System<Policy> system(config);
+    if (config.dump) return;
+    system.run_program();
+}
 
 int main(int argc, char *argv[]) {
  
@@ -142,9 +369,10 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    vpu::System system(config);
-    if (config.dump) return 0;
-    system.run_program();
+    if (vpu::instrument::wants_instrumentation(config))
+        run<vpu::instrument::Instrumented>(config);
+    else
+        run<vpu::instrument::Headless>(config);
 
     return 0;
 }
@@ -1,59 +1,80 @@
 #include <iostream>
 #include <assert.h>
 #include <optional>
+#include <unistd.h>
 
 #include "defs_pkg.h"
 #include "manager_core.h"
+#include "host_timer.h"
 
 namespace vpu {
 
-uint32_t ManagerCoreSnooper::get_register(ManagerCore& core, vpu::defs::Register reg) {
-    return core.registers[reg];
-}
-
-ManagerCore::ManagerCore(
+template <typename Policy>
+ManagerCore<Policy>::ManagerCore(
     vpu::config::Config& config,
     std::unique_ptr<vpu::mem::Memory>& memory,
-    Scheduler& scheduler
+    Scheduler& scheduler,
+    DMA& dma
 ) :
     config(config),
     memory(memory),
     scheduler(scheduler),
+    dma(dma),
     has_halted(false)
 {
     registers.fill(0);
     flags.fill(0);
+    execute_feedback_reg_held.fill(false);
+    execute_feedback_reg_value.fill(0);
     btb.fill(0xDEADBEEF);
     bht.fill(false);
+    if (Policy::STATUS && config.trace_file != "")
+        trace_writer = std::make_unique<vpu::trace::TraceWriter>(config.trace_file, config.trace_ring, registers, flags);
+    if (Policy::STATUS && config.pipeview != "")
+        pipeview = std::make_unique<vpu::trace::PipeView>(config.pipeview, config.output_buffer);
+    if (Policy::PROFILE && (config.profile != "" || config.profile_folded != ""))
+        profiler = std::make_unique<vpu::profile::Profiler>();
+    if (Policy::STATUS && (config.pipeline || config.trace)) {
+        //Anything already printed must come first
+        std::cout.flush();
+        status_output = std::make_unique<vpu::output::AsyncWriter>(
+            STDOUT_FILENO, config.output_buffer, config.output_policy == vpu::config::Config::OutputPolicy::DROP);
+    }
 }
 
-void ManagerCore::stage_pc(uint32_t new_pc) {
+template <typename Policy>
+void ManagerCore<Policy>::stage_pc(uint32_t new_pc) {
     potential_next_pc = new_pc;
 }
 
-void ManagerCore::update_pc() {
+template <typename Policy>
+void ManagerCore<Policy>::update_pc() {
     registers[vpu::defs::PC] = potential_next_pc;
 }
 
-void ManagerCore::run_cycle() {
+template <typename Policy>
+void ManagerCore<Policy>::run_cycle() {
+    HOST_TIMER(CORE);
+    if constexpr (Policy::STATUS)
+        if (pipeview) pipeview->start_cycle(vpu::defs::get_global_cycle());
+
     //Flush always happen
     uint32_t flush_addr = 0;
     bool flush_valid = false;
     if (!flush_queue.empty()){
-        auto flush_cycle = flush_queue.front().cycle;
+        auto flush_cycle = flush_queue.front_cycle();
         //In case we had no valid input for previous flush cycle
         if (vpu::defs::get_global_cycle() >= flush_cycle){
             flush_valid = true;
-            flush_addr = flush_queue.front().data;
+            flush_addr = flush_queue.front();
             flush_queue.pop_front();
+            counters.flushes++;
         }
     }
+    counters.cycles++;
 
-    status_fetch_opcode     = "";
-    status_decode_opcode    = "";
-    status_execute_opcode   = "";
-    status_memory_opcode    = "";
-    status_writeback_opcode = "";
+    if constexpr (Policy::STATUS)
+        for (auto& status : stage_status) status.valid = false;
 
     //Stall set by execute, therefore this one applies on the following cycle
                       stage_fetch(frontend_stall, flush_valid, flush_addr);
@@ -62,21 +83,56 @@ void ManagerCore::run_cycle() {
                       stage_memory();
                       stage_writeback();
 
+    if constexpr (Policy::PROFILE) profile_cycle();
+
     //Delay run cycle for a stall
     if (frontend_stall) {
-        for (auto& d : decode_input_queue) d.increment();
-        for (auto& e : execute_input_queue) e.increment();
+        decode_input_queue.stall();
+        execute_input_queue.stall();
+    }
+
+    //Wrong path instructions in decode and execute are dropped below
+    if constexpr (Policy::STATUS) {
+        if (pipeview && flush_valid) {
+            if (!frontend_stall && decode_input_queue.can_run()) pipeview->flush(decode_input_queue.front().seq);
+            if (!frontend_stall && execute_input_queue.can_run()) pipeview->flush(execute_input_queue.front().seq);
+        }
     }
 
     //Queue and PC updates happen at the end of the current cycle
     if (!frontend_stall) update_pc();
-    if (!frontend_stall && decode_input_queue.size()    && decode_input_queue.front().can_run()   ) decode_input_queue.pop_front();
-    if (!frontend_stall && execute_input_queue.size()   && execute_input_queue.front().can_run()  ) execute_input_queue.pop_front();
-    if (                   memory_input_queue.size()    && memory_input_queue.front().can_run()   ) memory_input_queue.pop_front();
-    if (                   writeback_input_queue.size() && writeback_input_queue.front().can_run()) writeback_input_queue.pop_front();
+    if (!frontend_stall && decode_input_queue.can_run()   ) decode_input_queue.pop_front();
+    if (!frontend_stall && execute_input_queue.can_run()  ) execute_input_queue.pop_front();
+    if (                   memory_input_queue.can_run()   ) memory_input_queue.pop_front();
+    if (                   writeback_input_queue.can_run()) writeback_input_queue.pop_front();
 }
 
-void ManagerCore::stage_fetch(bool stall, bool flush_valid, uint32_t flush_addr) {
+template <typename Policy>
+uint32_t ManagerCore<Policy>::next_event_cycle() {
+    uint32_t now = vpu::defs::get_global_cycle();
+    //Anything still moving through the back of the pipeline changes state
+    if (!frontend_stall || has_halted || !flush_queue.empty()) return now;
+    if (!memory_input_queue.empty() || !writeback_input_queue.empty()) return now;
+    //Decode halts on the end of the program even while stalled
+    if (!decode_input_queue.empty() && decode_input_queue.front().instruction == vpu::defs::SEGMENT_END) return now;
+    if (!execute_input_queue.can_run()) return now;
+    //A stalled cycle refetches, redecodes and resubmits the same instructions without effect
+    if (scheduler.can_accept(execute_input_queue.front().opcode)) return now;
+    return NO_EVENT;
+}
+
+template <typename Policy>
+void ManagerCore<Policy>::skip_cycles(uint32_t cycles) {
+    assert(!Policy::STATUS && !Policy::PROFILE);
+    counters.cycles += cycles;
+    counters.scheduler_stall_cycles += cycles;
+    decode_input_queue.stall(cycles);
+    execute_input_queue.stall(cycles);
+}
+
+template <typename Policy>
+void ManagerCore<Policy>::stage_fetch(bool stall, bool flush_valid, uint32_t flush_addr) {
+    HOST_TIMER(FETCH);
     //When we've hit a HLT and have not seen a flush then do not dispatch more instructions
     if (fetch_seen_hlt && !flush_valid){ 
         return;
@@ -92,6 +148,7 @@ void ManagerCore::stage_fetch(bool stall, bool flush_valid, uint32_t flush_addr)
         pc = flush_addr;
     }
 
+    dma.sync(pc, 4, false);
     uint32_t decode_instruction = memory->read_word(pc);
 
     //Halt after flush to retain correct final PC on HLT flush
@@ -99,7 +156,10 @@ void ManagerCore::stage_fetch(bool stall, bool flush_valid, uint32_t flush_addr)
         return;
     }
 
-    status_fetch_opcode = vpu::defs::opcode_to_string_fixed(vpu::defs::get_opcode(decode_instruction));
+    record_stage(FETCH, vpu::defs::get_opcode(decode_instruction));
+    uint64_t seq = 0;
+    if constexpr (Policy::STATUS)
+        if (pipeview) seq = pipeview->fetch(pc, vpu::defs::get_opcode(decode_instruction));
 
     if (stall)
         return;
@@ -121,30 +181,26 @@ void ManagerCore::stage_fetch(bool stall, bool flush_valid, uint32_t flush_addr)
         stage_pc(next_pc);
     }
 
-    decode_input_queue.push_back(DecodeInput{decode_instruction,pc,potential_next_pc});
+    decode_input_queue.push_back(DecodeInput{decode_instruction,pc,potential_next_pc,seq});
+    if constexpr (Policy::STATUS)
+        if (pipeview) pipeview->fetched();
 }
 
-void ManagerCore::stage_decode(bool stall) {
-    if (decode_input_queue.empty() || !decode_input_queue.front().can_run()) return;
-
-    assert(decode_input_queue.front().cycle == vpu::defs::get_global_cycle());
-    auto input = decode_input_queue.front().data;
-
-    if (input.instruction == vpu::defs::SEGMENT_END){
-        has_halted = true;
-        return;
-    }
-
-    //If above not triggered then the output must be valid
-    auto execute_opcode = vpu::defs::get_opcode(input.instruction);
-    uint8_t reg_index;
-
-    vpu::defs::Register execute_dest = (vpu::defs::Register)0;
-    uint32_t execute_source0 = 0;
-    uint32_t execute_source1 = 0;
+template <typename Policy>
+typename ManagerCore<Policy>::DecodedInstruction ManagerCore<Policy>::decode_instruction(uint32_t instruction, uint32_t pc) {
+    DecodedInstruction decoded;
+    decoded.valid = true;
+    decoded.pc = pc;
+    decoded.instruction = instruction;
+    decoded.opcode = vpu::defs::get_opcode(instruction);
+    decoded.dest = (vpu::defs::Register)0;
+    decoded.source0 = 0;
+    decoded.source1 = 0;
+    decoded.source0_kind = OperandKind::NONE;
+    decoded.source1_kind = OperandKind::NONE;
 
     //dest
-    switch(execute_opcode) {
+    switch(decoded.opcode) {
         //Nothing
         case vpu::defs::NOP:
         case vpu::defs::HLT:
@@ -162,12 +218,12 @@ void ManagerCore::stage_decode(bool stall) {
         case vpu::defs::ASR_R:
         case vpu::defs::LSR_R:
         case vpu::defs::LSL_R:
-            execute_dest = vpu::defs::ACC;
+            decoded.dest = vpu::defs::ACC;
             break;
         //Register destination
         case vpu::defs::MOV_R_I16:
         case vpu::defs::MOV_R_R:
-            execute_dest = vpu::defs::get_register(input.instruction,0);
+            decoded.dest = vpu::defs::get_register(instruction,0);
             break;
         
         //Pipes
@@ -183,13 +239,13 @@ void ManagerCore::stage_decode(bool stall) {
         case vpu::defs::P_BLI_COL_R:
             break;
         default:
-            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(execute_opcode);
-            std::cerr << " at address " << std::hex << PC();
+            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(decoded.opcode);
+            std::cerr << " at address " << std::hex << pc;
             std::cerr << " for dest operand" << std::endl;
             assert(false);
     }
     //source0
-    switch(execute_opcode) {
+    switch(decoded.opcode) {
         //Nothing
         case vpu::defs::NOP:
         case vpu::defs::HLT:
@@ -200,26 +256,31 @@ void ManagerCore::stage_decode(bool stall) {
         case vpu::defs::ASR_I24:
         case vpu::defs::LSR_I24:
         case vpu::defs::LSL_I24:
-            execute_source0 = vpu::defs::get_u24(input.instruction);
+            decoded.source0 = vpu::defs::get_u24(instruction);
+            decoded.source0_kind = OperandKind::IMMEDIATE;
             break;
         //Register destination
         case vpu::defs::MOV_R_I16:
-            execute_source0 = vpu::defs::get_u16(input.instruction);
+            decoded.source0 = vpu::defs::get_u16(instruction);
+            decoded.source0_kind = OperandKind::IMMEDIATE;
             break;
         case vpu::defs::CMP_R:
         case vpu::defs::ASR_R:
         case vpu::defs::LSR_R:
         case vpu::defs::LSL_R:
-            execute_source0 = (uint32_t)vpu::defs::get_register(input.instruction,0);
+            decoded.source0 = (uint32_t)vpu::defs::get_register(instruction,0);
+            decoded.source0_kind = OperandKind::REGISTER;
             break;
         case vpu::defs::CMP_R_R:
         case vpu::defs::MOV_R_R:
-            execute_source0 = (uint32_t)vpu::defs::get_register(input.instruction,1);
+            decoded.source0 = (uint32_t)vpu::defs::get_register(instruction,1);
+            decoded.source0_kind = OperandKind::REGISTER;
             break;
         //Label
         case vpu::defs::JMP_L:
         case vpu::defs::BRA_L:
-            execute_source0 = vpu::defs::get_label(input.instruction);
+            decoded.source0 = vpu::defs::get_label(instruction);
+            decoded.source0_kind = OperandKind::IMMEDIATE;
             break;
         //Pipes
         //Nothing
@@ -234,16 +295,17 @@ void ManagerCore::stage_decode(bool stall) {
         case vpu::defs::P_DMA_SET_R:
         case vpu::defs::P_BLI_COL_R:
         case vpu::defs::P_BLI_PIX_R_R:
-            execute_source0 = (uint32_t)vpu::defs::get_register(input.instruction,0);
+            decoded.source0 = (uint32_t)vpu::defs::get_register(instruction,0);
+            decoded.source0_kind = OperandKind::REGISTER;
             break;
         default:
-            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(execute_opcode);
-            std::cerr << " at address " << std::hex << PC();
+            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(decoded.opcode);
+            std::cerr << " at address " << std::hex << pc;
             std::cerr << " source operand" << std::endl;
             assert(false);
     }
     //source1
-    switch(execute_opcode) {
+    switch(decoded.opcode) {
         //Nothing
         case vpu::defs::NOP:
         case vpu::defs::HLT:
@@ -261,13 +323,16 @@ void ManagerCore::stage_decode(bool stall) {
         case vpu::defs::ASR_R:
         case vpu::defs::LSR_R:
         case vpu::defs::LSL_R:
-            execute_source1 = (uint32_t)vpu::defs::ACC;
+            decoded.source1 = (uint32_t)vpu::defs::ACC;
+            decoded.source1_kind = OperandKind::REGISTER;
             break;
         case vpu::defs::CMP_R_R:
-            execute_source1 = (uint32_t)vpu::defs::get_register(input.instruction,0);
+            decoded.source1 = (uint32_t)vpu::defs::get_register(instruction,0);
+            decoded.source1_kind = OperandKind::REGISTER;
             break;
         case vpu::defs::CMP_R:
-            execute_source1 = 0;
+            decoded.source1 = 0;
+            decoded.source1_kind = OperandKind::IMMEDIATE;
         //Pipes
         case vpu::defs::P_SCH_FNC:
         case vpu::defs::P_DMA_CPY:
@@ -279,140 +344,71 @@ void ManagerCore::stage_decode(bool stall) {
         case vpu::defs::P_BLI_CLR:
             break;
         case vpu::defs::P_BLI_PIX_R_R:
-            execute_source1 = (uint32_t)vpu::defs::get_register(input.instruction,1);
+            decoded.source1 = (uint32_t)vpu::defs::get_register(instruction,1);
+            decoded.source1_kind = OperandKind::REGISTER;
             break;
         default:
-            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(execute_opcode);
-            std::cerr << " at address " << std::hex << PC();
+            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(decoded.opcode);
+            std::cerr << " at address " << std::hex << pc;
             std::cerr << " source operand" << std::endl;
             assert(false);
     }
 
-    status_decode_opcode = vpu::defs::opcode_to_string_fixed(execute_opcode);
+
+    return decoded;
+}
+
+template <typename Policy>
+void ManagerCore<Policy>::stage_decode(bool stall) {
+    HOST_TIMER(DECODE);
+    if (!decode_input_queue.can_run()) return;
+
+    assert(decode_input_queue.front_cycle() == vpu::defs::get_global_cycle());
+    auto input = decode_input_queue.front();
+    pipeview_stage(input.seq, vpu::trace::PipeView::DECODE);
+
+    if (input.instruction == vpu::defs::SEGMENT_END){
+        has_halted = true;
+        return;
+    }
+
+    //If above not triggered then the output must be valid
+    auto& decoded = decode_cache[(input.pc >> 2) % DECODE_CACHE_SIZE];
+    if (!decoded.valid || decoded.pc != input.pc || decoded.instruction != input.instruction)
+        decoded = decode_instruction(input.instruction, input.pc);
+
+    record_stage(DECODE, decoded.opcode);
     if (!stall) {
         execute_input_queue.push_back(ExecuteInput{
-                execute_opcode,
-                execute_dest,
-                execute_source0,
-                execute_source1,
+                decoded.opcode,
+                decoded.dest,
+                decoded.source0,
+                decoded.source1,
+                decoded.source0_kind,
+                decoded.source1_kind,
                 input.pc,
-                input.next_pc
+                input.next_pc,
+                input.seq
             }
         );
     }
 }
 
-void ManagerCore::stage_execute() {
-    if (execute_input_queue.empty() || !execute_input_queue.front().can_run()) return;
+template <typename Policy>
+void ManagerCore<Policy>::stage_execute() {
+    HOST_TIMER(EXECUTE);
+    if (!execute_input_queue.can_run()) return;
 
-    auto input = execute_input_queue.front().data;
-    assert(execute_input_queue.front().cycle == vpu::defs::get_global_cycle());
+    auto input = execute_input_queue.front();
+    assert(execute_input_queue.front_cycle() == vpu::defs::get_global_cycle());
 
     vpu::defs::Register memory_reg_index = (vpu::defs::Register)0; //indicated PC, which is invalid and will be ignored
     uint32_t memory_reg_value = 0;
     vpu::defs::Opcode memory_opcode = input.opcode;
 
-    uint32_t source_value0 = 0;
-    uint32_t source_value1 = 0;    
+    uint32_t source_value0 = operand_value(input.source0_kind, input.source0);
+    uint32_t source_value1 = operand_value(input.source1_kind, input.source1);
 
-    //source0
-    switch(input.opcode) {
-        //Nothing
-        case vpu::defs::NOP:
-        case vpu::defs::HLT:
-            break;
-        //Immediate 24-bit
-        case vpu::defs::MOV_I24:
-        case vpu::defs::ADD_I24:
-        case vpu::defs::ASR_I24:
-        case vpu::defs::LSR_I24:
-        case vpu::defs::LSL_I24:
-        case vpu::defs::MOV_R_I16:
-        case vpu::defs::JMP_L:
-        case vpu::defs::BRA_L:
-            source_value0 = input.source0;
-            break;
-        case vpu::defs::CMP_R:
-        case vpu::defs::ASR_R:
-        case vpu::defs::LSR_R:
-        case vpu::defs::LSL_R:
-        case vpu::defs::CMP_R_R:
-        case vpu::defs::MOV_R_R:
-            source_value0 = execute_feedback_reg_held[input.source0] ?
-                                    execute_feedback_reg_value[input.source0] :
-                                    registers[input.source0];
-            break;
-        //Pipes
-        //Nothing
-        case vpu::defs::P_SCH_FNC:
-        case vpu::defs::P_DMA_CPY:
-        case vpu::defs::P_BLI_CLR:
-            break;
-        //Register
-        case vpu::defs::P_DMA_DST_R:
-        case vpu::defs::P_DMA_SRC_R:
-        case vpu::defs::P_DMA_LEN_R:
-        case vpu::defs::P_DMA_SET_R:
-        case vpu::defs::P_BLI_COL_R:
-        case vpu::defs::P_BLI_PIX_R_R:
-            source_value0 = execute_feedback_reg_held[input.source0] ?
-                                    execute_feedback_reg_value[input.source0] :
-                                    registers[input.source0];
-            break;
-        default:
-            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(input.opcode);
-            std::cerr << " at address " << std::hex << PC();
-            std::cerr << " source operand" << std::endl;
-            assert(false);
-    }
-    //source1
-    switch(input.opcode) {
-        //Nothing
-        case vpu::defs::NOP:
-        case vpu::defs::HLT:
-        case vpu::defs::MOV_I24:
-        case vpu::defs::MOV_R_I16:
-        case vpu::defs::MOV_R_R:
-        case vpu::defs::JMP_L:
-        case vpu::defs::BRA_L:
-        case vpu::defs::CMP_R:
-            source_value1 = input.source1;
-            break;
-        //applied to ACC
-        case vpu::defs::ADD_I24:
-        case vpu::defs::ASR_I24:
-        case vpu::defs::LSR_I24:
-        case vpu::defs::LSL_I24:
-        case vpu::defs::ASR_R:
-        case vpu::defs::LSR_R:
-        case vpu::defs::LSL_R:
-        case vpu::defs::CMP_R_R:
-            source_value1 = execute_feedback_reg_held[input.source1] ?
-                                    execute_feedback_reg_value[input.source1] :
-                                    registers[input.source1];
-            break;
-        //Pipes
-        case vpu::defs::P_SCH_FNC:
-        case vpu::defs::P_DMA_CPY:
-        case vpu::defs::P_DMA_DST_R:
-        case vpu::defs::P_DMA_SRC_R:
-        case vpu::defs::P_DMA_LEN_R:
-        case vpu::defs::P_DMA_SET_R:
-        case vpu::defs::P_BLI_CLR:
-        case vpu::defs::P_BLI_COL_R:
-            break;
-        case vpu::defs::P_BLI_PIX_R_R:
-            source_value1 = execute_feedback_reg_held[input.source1] ?
-                                    execute_feedback_reg_value[input.source1] :
-                                    registers[input.source1];
-            break;
-        default:
-            std::cerr << "Error decoding opcode " << vpu::defs::opcode_to_string(input.opcode);
-            std::cerr << " at address " << std::hex << PC();
-            std::cerr << " source operand" << std::endl;
-            assert(false);
-    }
-    
     bool check_flush = false;
     bool successful_submit = true;
     uint32_t memory_next_pc;
@@ -479,14 +475,19 @@ void ManagerCore::stage_execute() {
     }
 
     //Do before the stall
-    status_execute_opcode = vpu::defs::opcode_to_string_fixed(input.opcode);
+    record_stage(EXECUTE, input.opcode);
 
     //Scheduler stall
     if (!successful_submit){
+        profile_execute(input.pc, input.opcode == vpu::defs::P_SCH_FNC ? vpu::profile::FENCE_WAIT : vpu::profile::SCHEDULER_STALL);
+        counters.scheduler_stall_cycles++;
+        pipeview_stage(input.seq, vpu::trace::PipeView::EXECUTE_STALL);
         frontend_stall = true; 
         return;
     }
     frontend_stall = false;
+    pipeview_stage(input.seq, vpu::trace::PipeView::EXECUTE);
+    profile_execute(input.pc, vpu::profile::EXECUTING);
 
     if (memory_reg_index != (vpu::defs::Register)0){
         execute_feedback_reg_held[(size_t)memory_reg_index] = true;
@@ -494,6 +495,14 @@ void ManagerCore::stage_execute() {
     }
 
     if (check_flush) {
+        //Direction comes from the BHT, the target of a predicted taken branch from the BTB
+        bool predicted_taken = input.next_pc != input.pc + 4;
+        bool taken = memory_next_pc != input.pc + 4;
+        if (predicted_taken == taken) counters.bht_hits++; else counters.bht_misses++;
+        if (predicted_taken && taken) {
+            if (input.next_pc == memory_next_pc) counters.btb_hits++; else counters.btb_misses++;
+        }
+
         //branch pred miss
         if (input.next_pc != memory_next_pc){
             //missed on fallthrough
@@ -504,6 +513,10 @@ void ManagerCore::stage_execute() {
             
             //Must flush to resolve the misprediction
             flush_queue.push_back(memory_next_pc);
+            if constexpr (Policy::PROFILE) {
+                profile_refilling = true;
+                profile_flush_pc = input.pc;
+            }
         } 
         
         //branch pred hit 
@@ -515,32 +528,56 @@ void ManagerCore::stage_execute() {
         }
     }
 
-    memory_input_queue.push_back(MemoryInput{memory_opcode, memory_reg_index!=0, memory_reg_index, memory_reg_value});
+    memory_input_queue.push_back(MemoryInput{memory_opcode, memory_reg_index!=0, memory_reg_index, memory_reg_value, input.seq});
 }
 
-void ManagerCore::stage_memory() {
+template <typename Policy>
+uint32_t ManagerCore<Policy>::operand_value(OperandKind kind, uint32_t operand) {
+    switch (kind) {
+        case OperandKind::NONE:
+            return 0;
+        case OperandKind::IMMEDIATE:
+            return operand;
+        case OperandKind::REGISTER:
+            return execute_feedback_reg_held[operand] ?
+                        execute_feedback_reg_value[operand] :
+                        registers[operand];
+    }
+    assert(false);
+    return 0;
+}
+
+template <typename Policy>
+void ManagerCore<Policy>::stage_memory() {
+    HOST_TIMER(MEMORY);
     //TODO: Implement memory accessing
 
-    if (memory_input_queue.empty() || !memory_input_queue.front().can_run()) return;
+    if (!memory_input_queue.can_run()) return;
 
-    assert(memory_input_queue.front().cycle == vpu::defs::get_global_cycle());
-    auto input = memory_input_queue.front().data;
+    assert(memory_input_queue.front_cycle() == vpu::defs::get_global_cycle());
+    auto input = memory_input_queue.front();
 
-    status_memory_opcode = vpu::defs::opcode_to_string_fixed(input.opcode);
-    writeback_input_queue.push_back(WritebackInput{input.opcode, input.write, input.dest, input.value});
+    record_stage(MEMORY, input.opcode);
+    pipeview_stage(input.seq, vpu::trace::PipeView::MEMORY);
+    writeback_input_queue.push_back(WritebackInput{input.opcode, input.write, input.dest, input.value, input.seq});
 }
 
-void ManagerCore::stage_writeback() {
-    if (writeback_input_queue.empty() || !writeback_input_queue.front().can_run()) {
-        writeback_valid = false;
-        return;
-    }
+template <typename Policy>
+void ManagerCore<Policy>::stage_writeback() {
+    HOST_TIMER(WRITEBACK);
+    if (!writeback_input_queue.can_run()) return;
 
-    assert(writeback_input_queue.front().cycle == vpu::defs::get_global_cycle());
-    auto input = writeback_input_queue.front().data;
+    assert(writeback_input_queue.front_cycle() == vpu::defs::get_global_cycle());
+    auto input = writeback_input_queue.front();
 
-    writeback_valid = true;
-    writeback_opcode = input.opcode;
+    record_stage(WRITEBACK, input.opcode);
+    if constexpr (Policy::STATUS) {
+        if (pipeview) {
+            pipeview->stage(input.seq, vpu::trace::PipeView::WRITEBACK);
+            pipeview->retire(input.seq);
+        }
+    }
+    counters.retired_instructions++;
 
     if (input.opcode == vpu::defs::HLT)    
         has_halted = true;
@@ -550,99 +587,105 @@ void ManagerCore::stage_writeback() {
     if (execute_feedback_reg_value[input.dest] == input.value) {
         execute_feedback_reg_held[input.dest] = false;
     }
-    status_writeback_opcode = vpu::defs::opcode_to_string_fixed(input.opcode);
 }
 
-void ManagerCore::set_flag(vpu::defs::Flag flag) {
+//Charge the cycle to the instruction in execute, or for a bubble to the branch being
+//recovered from or the last instruction seen
+template <typename Policy>
+void ManagerCore<Policy>::profile_cycle() {
+    if (!profiler) return;
+    if (profile_sampled) {
+        profiler->sample(profile_pc, profile_cause);
+    } else if (profile_refilling) {
+        profiler->sample(profile_flush_pc, vpu::profile::FLUSH_REFILL);
+    } else {
+        profiler->sample(profile_pc, vpu::profile::PIPELINE_FILL);
+    }
+    profile_sampled = false;
+}
+
+template <typename Policy>
+void ManagerCore<Policy>::set_flag(vpu::defs::Flag flag) {
     flags[flag] = 1;
 }
 
-void ManagerCore::unset_flag(vpu::defs::Flag flag) {
+template <typename Policy>
+void ManagerCore<Policy>::unset_flag(vpu::defs::Flag flag) {
     flags[flag] = 0;
 }
 
-bool ManagerCore::get_flag(vpu::defs::Flag flag) {
+template <typename Policy>
+bool ManagerCore<Policy>::get_flag(vpu::defs::Flag flag) {
     return flags[flag];
 }
 
-bool ManagerCore::check_has_halted() {
+template <typename Policy>
+bool ManagerCore<Policy>::check_has_halted() {
     return has_halted;
 }
 
-uint32_t ManagerCore::PC() {
+template <typename Policy>
+uint32_t ManagerCore<Policy>::PC() {
     return registers[vpu::defs::PC];
 }
 
-void ManagerCore::print_status_start() {
+template <typename Policy>
+void ManagerCore<Policy>::print_status_start() {
+    if constexpr (!Policy::STATUS) return;
     if (!(config.pipeline || config.trace)) return;
 
-    std::cout << "           ";
+    std::string line = "           ";
     if (config.pipeline)
-        std::cout << "\t" << pipeline_heading();
+        line += "\t" + vpu::trace::pipeline_heading();
     if (config.trace)
-        std::cout << "\t" << trace_string();
-    std::cout << "\n";
+        line += "\t" + vpu::trace::registers_string(registers, flags);
+    line += "\n";
+    status_output->write(line);
 }
 
-void ManagerCore::print_status(uint32_t cycle) {
-    std::string cycle_str = "Cycle: " + std::to_string(cycle) + "  ";
-    if (config.pipeline || config.trace)
-        std::cout << cycle_str;
+template <typename Policy>
+void ManagerCore<Policy>::print_status(uint32_t cycle) {
+    if constexpr (!Policy::STATUS) return;
+    if (trace_writer)
+        trace_writer->record(cycle, registers, flags, stage_status);
+
+    if (!config.pipeline && !config.trace)
+        return;
+
+    //Formatted as one write so output dropped on a full buffer is always whole lines
+    std::string line = "Cycle: " + std::to_string(cycle) + "  ";
 
     if (config.pipeline)
-        std::cout << "\t" << pipeline_string();
+        line += "\t" + vpu::trace::pipeline_string(stage_status);
 
     if (config.trace)
-        std::cout << "\t" << trace_string();
+        line += "\t" + vpu::trace::registers_string(registers, flags);
 
-    if (config.pipeline || config.trace)
-        std::cout << "\n";
+    line += "\n";
+    status_output->write(line);
 }
 
-std::string ManagerCore::pipeline_heading() {
-    std::array<std::string, 5> headers = {"FETCH","DECODE","EXECUTE","MEMORY","WRITEBACK"};
-    
-    std::string op = "|";
-    for (auto& h : headers){
-        op += " ";
-        h.insert(0, vpu::defs::MAX_OPCODE_LEN - h.size(), ' ');
-        op += h;
-        op += " |";
-    }
-
-    return op;
+template <typename Policy>
+void ManagerCore<Policy>::flush_status() {
+    if constexpr (!Policy::STATUS) return;
+    if (status_output)
+        status_output->flush();
 }
 
-std::string ManagerCore::pipeline_string() {
-    std::string op;    
-    std::string na(vpu::defs::MAX_OPCODE_LEN, '-');
-    uint32_t cycle = vpu::defs::get_global_cycle();
-    op += "| ";
-    op += status_fetch_opcode.length() ? status_fetch_opcode : na;
-    op += " | ";
-    op += status_decode_opcode.length() ? status_decode_opcode : na;
-    op += " | ";
-    op += status_execute_opcode.length() ? status_execute_opcode : na;
-    op += " | ";
-    op += status_memory_opcode.length() ? status_memory_opcode : na;
-    op += " | ";
-    op += writeback_valid ? vpu::defs::opcode_to_string_fixed(writeback_opcode) : na;
-    op += " |";
-
-    return op;
+template <typename Policy>
+void ManagerCore<Policy>::register_counters(vpu::stats::Registry& registry) {
+    registry.counter("core", "cycles", counters.cycles, "Cycles simulated");
+    registry.counter("core", "retired_instructions", counters.retired_instructions, "Instructions reaching writeback");
+    registry.ratio("core", "cpi", counters.cycles, counters.retired_instructions, "Cycles per retired instruction");
+    registry.counter("core", "scheduler_stall_cycles", counters.scheduler_stall_cycles, "Frontend stalls from the scheduler refusing a pipe instruction");
+    registry.counter("core", "flushes", counters.flushes, "Pipeline flushes from mispredicted branches");
+    registry.counter("core", "bht_hits", counters.bht_hits, "Branches with the predicted direction");
+    registry.counter("core", "bht_misses", counters.bht_misses, "Branches against the predicted direction");
+    registry.counter("core", "btb_hits", counters.btb_hits, "Predicted taken branches with the right target");
+    registry.counter("core", "btb_misses", counters.btb_misses, "Predicted taken branches with the wrong target");
 }
 
-std::string ManagerCore::trace_string() {
-    std::string op;
-    for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++){
-        op += vpu::defs::register_to_string((vpu::defs::Register)i);
-        op +=  " " + std::to_string(registers[i]) + " \t";
-    }
-    for (int i = 0; i < vpu::defs::FLAG_COUNT; i++){
-        op += vpu::defs::flag_to_string((vpu::defs::Flag)i);
-        op += " " + std::to_string(flags[i]) + " \t";
-    }
-    return op;
-}
+template class ManagerCore<instrument::Headless>;
+template class ManagerCore<instrument::Instrumented>;
 
 }
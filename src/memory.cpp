@@ -2,60 +2,382 @@
 #include "defs_pkg.h"
 #include <assert.h>
 #include <algorithm>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 namespace vpu::mem {
 
+//Read target for every page that has not been written yet
+static const std::array<uint8_t,PAGE_SIZE> zero_page{};
+
 uint8_t MemorySnooper::get_byte(std::unique_ptr<Memory>& memory, uint32_t index) {
-    return memory->data[index];
+    return memory->read_pages[index >> PAGE_BITS][index & PAGE_MASK];
 }
 
 void MemorySnooper::copy_file_in(std::unique_ptr<Memory>& memory, std::filesystem::path file) {
-    std::ifstream program(file, std::ios::binary | std::ios::in);
-    if (!program.is_open()) {
+    int fd = open(file.c_str(), O_RDONLY);
+    if (fd < 0) {
         std::cerr << "Failed to open " << file << " for reading.";
         exit(1);
     }
-    //Copying to a vector then array seems silly, but going directly to the array fails to compile
-    std::vector<char> new_data{std::istreambuf_iterator<char>(program), std::istreambuf_iterator<char>()};
-    std::copy(new_data.begin(), new_data.end(), memory->data.begin());
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        std::cerr << "Failed to read size of " << file << ": " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+    size_t size = file_stat.st_size;
+
+    SectionedHeader header;
+    bool sectioned = size >= sizeof(header)
+                  && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+                  && header.magic == SECTIONED_MAGIC;
+
+    //Raw images are loaded flat from address 0
+    if (!sectioned) {
+        if (size > vpu::defs::MEM_SIZE) {
+            std::cerr << "Error: program " << file << " is " << size << " bytes, larger than the "
+                      << vpu::defs::MEM_SIZE << " byte memory." << std::endl;
+            exit(1);
+        }
+        memory->load_file(fd, 0, 0, size);
+        close(fd);
+        return;
+    }
+
+    //Check the count against the file size before allocating, it comes straight from the file
+    if (header.segment_count > (size - sizeof(header)) / sizeof(SegmentHeader)) {
+        std::cerr << "Error: program " << file << " has a truncated segment table." << std::endl;
+        exit(1);
+    }
+    std::vector<SegmentHeader> segments(header.segment_count);
+    size_t table_size = segments.size() * sizeof(SegmentHeader);
+    if (pread(fd, segments.data(), table_size, sizeof(header)) != (ssize_t)table_size) {
+        std::cerr << "Error: program " << file << " has a truncated segment table." << std::endl;
+        exit(1);
+    }
+
+    for (size_t i = 0; i < segments.size(); i++) {
+        auto& segment = segments[i];
+        bool zero_fill = segment.flags & SEGMENT_ZERO_FILL;
+        if ((uint64_t)segment.address + segment.length > vpu::defs::MEM_SIZE) {
+            std::cerr << "Error: segment " << i << " of " << file << " at 0x" << std::hex << segment.address
+                      << " with length 0x" << segment.length << std::dec << " extends beyond the end of memory." << std::endl;
+            exit(1);
+        }
+        if (!zero_fill && (uint64_t)segment.file_offset + segment.length > size) {
+            std::cerr << "Error: segment " << i << " of " << file << " extends beyond the end of the file." << std::endl;
+            exit(1);
+        }
+
+        if (zero_fill)
+            memory->zero_fill(segment.address, segment.length);
+        else
+            memory->load_file(fd, segment.file_offset, segment.address, segment.length);
+    }
+    close(fd);
 }
 
-std::array<uint8_t,vpu::defs::MEM_SIZE>& MemorySnooper::get_data(std::unique_ptr<Memory>& memory) {
-    return memory->data;
+void MemorySnooper::get_data(std::unique_ptr<Memory>& memory, uint32_t addr, std::span<uint8_t> out) {
+    assert(addr + out.size() <= vpu::defs::MEM_SIZE);
+    size_t done = 0;
+    while (done < out.size()) {
+        uint32_t offset = (addr + done) & PAGE_MASK;
+        size_t chunk = std::min<size_t>(PAGE_SIZE - offset, out.size() - done);
+        std::memcpy(out.data() + done, memory->read_pages[(addr + done) >> PAGE_BITS] + offset, chunk);
+        done += chunk;
+    }
 }
 
-Memory::Memory() {
-    std::cout << vpu::defs::MEM_SIZE;
-    std::fill(data.begin(), data.begin()+vpu::defs::MEM_SIZE, 0);
+std::span<const uint8_t,PAGE_SIZE> MemorySnooper::get_page(std::unique_ptr<Memory>& memory, uint32_t page) {
+    assert(page < PAGE_COUNT);
+    return std::span<const uint8_t,PAGE_SIZE>(memory->read_pages[page], PAGE_SIZE);
 }
 
-uint32_t Memory::read_word(uint32_t addr) {
-    addr &= 0xFFFFFFFC;
-    uint32_t ret = 0;
-    for (size_t i = 0; i<4; i++)
-        ret |= data[addr+i] << (i*8);
-    return ret;
+bool MemorySnooper::page_allocated(std::unique_ptr<Memory>& memory, uint32_t page) {
+    assert(page < PAGE_COUNT);
+    return memory->page_data[page] != nullptr;
+}
+
+Memory::Memory(MemoryBackend backend) {
+    read_pages.fill(zero_page.data());
+    write_pages.fill(nullptr);
+    page_data.fill(nullptr);
+    watched_pages.fill(false);
+    if (backend != MemoryBackend::PAGED)
+        map_dense(backend);
+}
+
+Memory::~Memory() {
+    if (dense_mapping != nullptr)
+        munmap(dense_mapping, dense_mapping_size);
+    for (auto& [mapping, size] : file_mappings)
+        munmap(mapping, size);
+}
+
+void Memory::load_file(int fd, size_t file_offset, uint32_t addr, size_t length) {
+    assert(addr + length <= vpu::defs::MEM_SIZE);
+    if (length == 0) return;
+
+    //Dense memory is already mapped, so read straight into it
+    if (dense_mapping != nullptr) {
+        size_t done = 0;
+        while (done < length) {
+            ssize_t ret = pread(fd, dense_mapping + addr + done, length - done, file_offset + done);
+            if (ret <= 0) {
+                std::cerr << "Failed to read program file: " << (ret == 0 ? "unexpected end of file" : std::strerror(errno)) << std::endl;
+                exit(1);
+            }
+            done += ret;
+        }
+        return;
+    }
+
+    //mmap offsets must be aligned to the system page size
+    size_t map_offset = file_offset - file_offset % sysconf(_SC_PAGESIZE);
+    size_t map_size = length + (file_offset - map_offset);
+    void* mapping = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, map_offset);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map program file: " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+    const uint8_t* src = (uint8_t*)mapping + (file_offset - map_offset);
+
+    //Whole pages use the private mapping directly, the kernel copies them on first write.
+    //Partial pages at either end are copied in.
+    uint32_t end = addr + length;
+    uint32_t first_whole = (addr + PAGE_MASK) & ~PAGE_MASK;
+    uint32_t last_whole = end & ~PAGE_MASK;
+    if (first_whole >= last_whole) {
+        write_bytes(addr, src, length);
+        munmap(mapping, map_size);
+        return;
+    }
+    write_bytes(addr, src, first_whole - addr);
+    write_bytes(last_whole, src + (last_whole - addr), end - last_whole);
+
+    bool mapped = false;
+    for (uint32_t page_addr = first_whole; page_addr < last_whole; page_addr += PAGE_SIZE) {
+        uint32_t page = page_addr >> PAGE_BITS;
+        uint8_t* data = (uint8_t*)src + (page_addr - addr);
+        //Already written pages keep their storage
+        if (page_data[page] != nullptr) {
+            std::memcpy(get_write_page(page_addr), data, PAGE_SIZE);
+            continue;
+        }
+        read_pages[page] = data;
+        write_pages[page] = data;
+        page_data[page] = data;
+        mapped = true;
+    }
+
+    if (mapped)
+        file_mappings.emplace_back(mapping, map_size);
+    else
+        munmap(mapping, map_size);
+}
+
+//Default explicit hugepage size from /proc/meminfo, 0 when unknown
+static size_t system_hugepage_size() {
+    std::ifstream meminfo("/proc/meminfo");
+    std::string key;
+    while (meminfo >> key) {
+        if (key == "Hugepagesize:") {
+            size_t kb = 0;
+            meminfo >> kb;
+            return kb * 1024;
+        }
+        meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return 0;
 }
-void Memory::write_word(uint32_t addr, uint32_t data) {
-    addr &= 0xFFFFFFFC;
-    for (size_t i = 0; i<4; i++)
-        this->data[addr+i] = 0xFF & (data >> 8*i);
+
+//Transparent hugepages can be requested with madvise unless the kernel has them set to never
+static bool transparent_hugepages_available() {
+    std::ifstream enabled("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string setting;
+    std::getline(enabled, setting);
+    return setting.size() && setting.find("[never]") == std::string::npos;
+}
+
+static size_t round_up(size_t value, size_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+void Memory::map_dense(MemoryBackend backend) {
+    using Backend = MemoryBackend;
+    size_t base_page_size = sysconf(_SC_PAGESIZE);
+    size_t hugepage_size = system_hugepage_size();
+    if (hugepage_size == 0) hugepage_size = 2 << 20;
+    size_t size = round_up((size_t)PAGE_COUNT * PAGE_SIZE, hugepage_size);
+    size_t page_size = base_page_size;
+    std::string description = "base pages";
+
+#ifdef MAP_HUGETLB
+    if (backend == Backend::DENSE_HUGETLB) {
+        //No MAP_NORESERVE, an empty hugepage pool must fail here rather than fault later
+        void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapping != MAP_FAILED) {
+            dense_mapping = (uint8_t*)mapping;
+            page_size = hugepage_size;
+            description = "explicit hugepages (MAP_HUGETLB)";
+        } else {
+            std::cerr << "Warning: MAP_HUGETLB mapping failed (" << std::strerror(errno) << "), falling back to transparent hugepages" << std::endl;
+            backend = Backend::DENSE_THP;
+        }
+    }
+#else
+    if (backend == Backend::DENSE_HUGETLB) {
+        std::cerr << "Warning: MAP_HUGETLB is not supported on this platform, falling back to transparent hugepages" << std::endl;
+        backend = Backend::DENSE_THP;
+    }
+#endif
+
+    if (dense_mapping == nullptr) {
+        //Over-allocate so the start can be aligned to a hugepage boundary, THP only backs aligned ranges
+        size_t padded_size = size + hugepage_size;
+        void* mapping = mmap(nullptr, padded_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapping == MAP_FAILED) {
+            std::cerr << "Failed to map " << size << " bytes of memory: " << std::strerror(errno) << std::endl;
+            exit(1);
+        }
+        uintptr_t start = (uintptr_t)mapping;
+        uintptr_t aligned = round_up(start, hugepage_size);
+        if (aligned != start) munmap(mapping, aligned - start);
+        munmap((void*)(aligned + size), padded_size - (aligned - start) - size);
+        dense_mapping = (uint8_t*)aligned;
+
+        if (backend == Backend::DENSE_THP) {
+#ifdef MADV_HUGEPAGE
+            if (!transparent_hugepages_available()) {
+                std::cerr << "Warning: transparent hugepages are disabled, falling back to base pages" << std::endl;
+            } else if (madvise(dense_mapping, size, MADV_HUGEPAGE) != 0) {
+                std::cerr << "Warning: madvise(MADV_HUGEPAGE) failed (" << std::strerror(errno) << "), falling back to base pages" << std::endl;
+            } else {
+                page_size = hugepage_size;
+                description = "transparent hugepages (MADV_HUGEPAGE)";
+            }
+#else
+            std::cerr << "Warning: transparent hugepages are not supported on this platform, falling back to base pages" << std::endl;
+#endif
+        }
+    }
+    dense_mapping_size = size;
+
+    for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+        read_pages[page] = dense_mapping + (size_t)page * PAGE_SIZE;
+        write_pages[page] = dense_mapping + (size_t)page * PAGE_SIZE;
+        page_data[page] = dense_mapping + (size_t)page * PAGE_SIZE;
+    }
+
+    std::cerr << "Memory backend: dense, " << page_size / 1024 << " KiB pages, " << description << std::endl;
+}
+
+uint8_t* Memory::allocate_page(uint32_t page) {
+    assert(page < PAGE_COUNT);
+    assert(page_data[page] == nullptr);
+    //Value initialisation zero fills
+    page_storage.push_back(std::make_unique<uint8_t[]>(PAGE_SIZE));
+    uint8_t* data = page_storage.back().get();
+    read_pages[page] = data;
+    write_pages[page] = data;
+    page_data[page] = data;
+    return data;
+}
+
+uint8_t* Memory::write_page_slow(uint32_t page) {
+    assert(page < PAGE_COUNT);
+    if (watched_pages[page]) {
+        watched_pages[page] = false;
+        for (auto& watcher : write_watchers)
+            watcher(page);
+        if (page_data[page] != nullptr) {
+            write_pages[page] = page_data[page];
+            return page_data[page];
+        }
+    }
+    return allocate_page(page);
+}
+
+void Memory::add_write_watcher(std::function<void(uint32_t)> watcher) {
+    write_watchers.push_back(watcher);
+}
+
+void Memory::watch_page(uint32_t page) {
+    assert(page < PAGE_COUNT);
+    watched_pages[page] = true;
+    write_pages[page] = nullptr;
+}
+
+void Memory::zero_fill(uint32_t addr, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        uint32_t offset = (addr + done) & PAGE_MASK;
+        size_t chunk = std::min<size_t>(PAGE_SIZE - offset, length - done);
+        //Unallocated pages already read as zero
+        if (page_data[(addr + done) >> PAGE_BITS] != nullptr)
+            std::memset(get_write_page(addr + done) + offset, 0, chunk);
+        done += chunk;
+    }
+}
+
+void Memory::write_bytes(uint32_t addr, const uint8_t* src, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        uint32_t offset = (addr + done) & PAGE_MASK;
+        size_t chunk = std::min<size_t>(PAGE_SIZE - offset, length - done);
+        std::memcpy(get_write_page(addr + done) + offset, src + done, chunk);
+        done += chunk;
+    }
+}
+
+void Memory::copy(uint32_t dest, uint32_t source, size_t length) {
+    assert(dest + length <= source || source + length <= dest);
+    assert(dest + length <= vpu::defs::MEM_SIZE && source + length <= vpu::defs::MEM_SIZE);
+    size_t done = 0;
+    while (done < length) {
+        uint32_t dest_offset = (dest + done) & PAGE_MASK;
+        uint32_t source_offset = (source + done) & PAGE_MASK;
+        size_t chunk = std::min<size_t>({PAGE_SIZE - dest_offset, PAGE_SIZE - source_offset, length - done});
+        //Writing may allocate the page being read from, so look the source up after
+        uint8_t* to = get_write_page(dest + done) + dest_offset;
+        const uint8_t* from = read_pages[(source + done) >> PAGE_BITS] + source_offset;
+        std::memcpy(to, from, chunk);
+        done += chunk;
+    }
+}
+
+void Memory::fill(uint32_t dest, uint8_t value, size_t length) {
+    assert(dest + length <= vpu::defs::MEM_SIZE);
+    size_t done = 0;
+    while (done < length) {
+        uint32_t offset = (dest + done) & PAGE_MASK;
+        size_t chunk = std::min<size_t>(PAGE_SIZE - offset, length - done);
+        std::memset(get_write_page(dest + done) + offset, value, chunk);
+        done += chunk;
+    }
 }
 
 std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> Memory::read(uint32_t addr) {
     assert((addr & 0x3F) == 0); //Must be 64-byte aligned
     assert(addr <= vpu::defs::MEM_SIZE-vpu::defs::MEM_ACCESS_WIDTH); //Don't read from beyond the end
     std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> ret;
-    std::copy(data.begin()+addr,data.begin()+addr+vpu::defs::MEM_ACCESS_WIDTH, ret.begin());
+    const uint8_t* page = read_pages[addr >> PAGE_BITS] + (addr & PAGE_MASK);
+    std::copy(page, page+vpu::defs::MEM_ACCESS_WIDTH, ret.begin());
     return ret;
 }
 
 void Memory::write(uint32_t addr, std::array<uint8_t,vpu::defs::MEM_ACCESS_WIDTH> write_data) {
     assert((addr & 0x3F) == 0); //Must be 64-byte aligned
     assert(addr <= vpu::defs::MEM_SIZE-vpu::defs::MEM_ACCESS_WIDTH); //Don't write beyond the end
-    std::copy(write_data.begin(), write_data.end(), data.begin() + addr);
+    std::copy(write_data.begin(), write_data.end(), get_write_page(addr) + (addr & PAGE_MASK));
 }
 
 }
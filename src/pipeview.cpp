@@ -0,0 +1,102 @@
+#include "pipeview.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace vpu::trace {
+
+static const std::array<const char*,7> stage_names = {"", "F", "D", "X", "Xs", "M", "W"};
+
+static void append_number(std::string& line, uint64_t value, int base = 10) {
+    char number[24];
+    line.append(number, std::to_chars(number, number + sizeof(number), value, base).ptr);
+}
+
+PipeView::PipeView(const std::string& path, size_t budget) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << path << " for writing: " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+    output = std::make_unique<vpu::output::AsyncWriter>(fd, budget, false);
+    line = "Kanata\t0004\nC=\t";
+    append_number(line, vpu::defs::get_global_cycle());
+    line += "\n";
+    cycle = vpu::defs::get_global_cycle();
+}
+
+PipeView::~PipeView() {
+    //Let the last writeback be drawn before it retires, anything else left in flight never will
+    for (uint64_t seq = next_seq > WINDOW ? next_seq - WINDOW : 0; seq < next_seq; seq++)
+        if (stages[seq % WINDOW] != NONE && std::find(retiring.begin(), retiring.end(), seq) == retiring.end())
+            end(seq, true);
+    start_cycle(cycle + 1);
+    //Writes out everything before the file is closed
+    output.reset();
+    close(fd);
+}
+
+void PipeView::start_cycle(uint64_t new_cycle) {
+    if (new_cycle != cycle) {
+        line += "C\t";
+        append_number(line, new_cycle - cycle);
+        line += "\n";
+        cycle = new_cycle;
+    }
+    for (auto seq : retiring)
+        end(seq, false);
+    retiring.clear();
+    output->write(line);
+    line.clear();
+}
+
+uint64_t PipeView::fetch(uint32_t pc, vpu::defs::Opcode opcode) {
+    if (fetch_pending) {
+        if (fetch_pc == pc) return fetch_seq;
+        //Redirected by a flush while stalled
+        end(fetch_seq, true);
+    }
+    fetch_pending = true;
+    fetch_seq = next_seq++;
+    fetch_pc = pc;
+
+    line += "I\t";
+    append_number(line, fetch_seq);
+    line += "\t";
+    append_number(line, fetch_seq);
+    line += "\t0\nL\t";
+    append_number(line, fetch_seq);
+    line += "\t0\t0x";
+    append_number(line, pc, 16);
+    line += ": ";
+    line += vpu::defs::opcode_to_string(opcode);
+    line += "\n";
+    stages[fetch_seq % WINDOW] = NONE;
+    stage(fetch_seq, FETCH);
+    return fetch_seq;
+}
+
+void PipeView::stage(uint64_t seq, Stage stage) {
+    if (stages[seq % WINDOW] == stage) return;
+    stages[seq % WINDOW] = stage;
+    line += "S\t";
+    append_number(line, seq);
+    line += "\t0\t";
+    line += stage_names[stage];
+    line += "\n";
+}
+
+void PipeView::end(uint64_t seq, bool flushed) {
+    stages[seq % WINDOW] = NONE;
+    line += "R\t";
+    append_number(line, seq);
+    line += "\t";
+    append_number(line, flushed ? 0 : retired++);
+    line += flushed ? "\t1\n" : "\t0\n";
+}
+
+}
@@ -0,0 +1,87 @@
+#include "profiler.h"
+#include "defs_pkg.h"
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <map>
+#include <vector>
+
+namespace vpu::profile {
+
+static const std::array<const char*,CAUSE_COUNT> cause_names = {
+    "executing", "scheduler_stall", "fence_wait", "flush_refill", "pipeline_fill"
+};
+
+static std::string hex(uint32_t value) {
+    char text[16];
+    std::snprintf(text, sizeof(text), "0x%08x", value);
+    return text;
+}
+
+//The program has no symbols, so every branch target becomes a label named after its address
+static std::map<uint32_t,std::string> find_labels(std::span<const uint32_t> program) {
+    std::map<uint32_t,std::string> labels = {{0, "start"}};
+    for (uint32_t word : program) {
+        vpu::defs::Opcode opcode = vpu::defs::get_opcode(word);
+        if (opcode == vpu::defs::JMP_L || opcode == vpu::defs::BRA_L) {
+            uint32_t target = vpu::defs::get_label(word);
+            if (target) labels.emplace(target, "L_" + hex(target));
+        }
+    }
+    return labels;
+}
+
+static std::string label_of(const std::map<uint32_t,std::string>& labels, uint32_t pc) {
+    auto label = labels.upper_bound(pc);
+    return (--label)->second;
+}
+
+static std::string instruction_of(std::span<const uint32_t> program, uint32_t pc) {
+    if (pc / 4 >= program.size()) return hex(pc) + " ?";
+    return hex(pc) + " " + vpu::defs::opcode_to_string(vpu::defs::get_opcode(program[pc / 4]));
+}
+
+void Profiler::write_table(std::ostream& out, std::span<const uint32_t> program) const {
+    auto labels = find_labels(program);
+
+    //Hottest first
+    std::vector<std::pair<uint32_t,uint64_t>> order;
+    uint64_t total_cycles = 0;
+    for (auto& [pc, counts] : samples) {
+        uint64_t total = 0;
+        for (auto count : counts) total += count;
+        order.push_back({pc, total});
+        total_cycles += total;
+    }
+    std::sort(order.begin(), order.end(), [](auto& a, auto& b) {
+        return a.second != b.second ? a.second > b.second : a.first < b.first;
+    });
+
+    out << std::left << std::setw(24) << "pc" << std::right << std::setw(12) << "cycles" << std::setw(8) << "%";
+    for (auto name : cause_names) out << std::setw(17) << name;
+    out << "  label\n";
+    for (auto& [pc, total] : order) {
+        auto& counts = samples.at(pc);
+        out << std::left << std::setw(24) << instruction_of(program, pc) << std::right << std::setw(12) << total;
+        out << std::setw(8) << std::fixed << std::setprecision(2) << 100.0 * total / total_cycles;
+        for (auto count : counts) out << std::setw(17) << count;
+        out << "  " << label_of(labels, pc) << "\n";
+    }
+    out << std::left << std::setw(24) << "total" << std::right << std::setw(12) << total_cycles << "\n";
+}
+
+void Profiler::write_folded(std::ostream& out, std::span<const uint32_t> program) const {
+    auto labels = find_labels(program);
+
+    //Sorted by PC so the output is stable between runs
+    std::map<uint32_t,std::array<uint64_t,CAUSE_COUNT>> ordered(samples.begin(), samples.end());
+    for (auto& [pc, counts] : ordered) {
+        std::string frames = label_of(labels, pc) + ";" + instruction_of(program, pc) + ";";
+        for (int cause = 0; cause < CAUSE_COUNT; cause++) {
+            if (counts[cause])
+                out << frames << cause_names[cause] << " " << counts[cause] << "\n";
+        }
+    }
+}
+
+}
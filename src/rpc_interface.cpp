@@ -16,8 +16,7 @@ std::array<uint8_t,512> ServerInterface::get_memory_segment(uint32_t addr) {
     std::cout << "interface call" << std::endl;
     assert((addr & 0xFF) == 0);
     std::array<uint8_t,512> ret;
-    auto data = mem::MemorySnooper::get_data(memory);
-    std::copy(data.begin()+addr,data.begin()+addr+512, ret.begin());
+    mem::MemorySnooper::get_data(memory, addr, ret);
     return ret;
 }
 
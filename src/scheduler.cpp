@@ -1,12 +1,17 @@
 #include "scheduler.h"
 #include "defs_pkg.h"
+#include "host_timer.h"
+#include <algorithm>
 #include <assert.h>
 #include <iostream>
 
 namespace vpu {
 
 Scheduler::Scheduler(DMA& dma, Blitter& blitter)
-    : dma(dma), blitter(blitter)
+    : dma(dma), blitter(blitter),
+    dma_frontend_queues(dma.channel_count()),
+    dma_outstanding(dma.channel_count(), 0),
+    dma_queue_occupancy(dma.channel_count() * vpu::defs::SCHEDULER_FRONTEND_QUEUE_SIZE + 1)
 {
  
 }
@@ -37,13 +42,14 @@ bool Scheduler::submit_dma(uint32_t valid_cycle, defs::Opcode opcode, uint32_t v
 
 
     //TODO need to confirm if this is actually correct RE cycle execution, same for other pipes
-    if (dma_frontend_queue.size() >= vpu::defs::SCHEDULER_FRONTEND_QUEUE_SIZE) {
+    if (!can_accept(opcode)) {
         return false;
     }
 
-    //When there is space, copy the frontend into the queue
-    dma_frontend_queue.push_back(core_dma_frontend_state);
-    dma_outstanding++;
+    //When there is space, copy the frontend into the queue of the least loaded channel
+    uint32_t channel = dma_channel_for_submit();
+    dma_frontend_queues[channel].push_back(core_dma_frontend_state);
+    dma_outstanding[channel]++;
     core_dma_frontend_state.operation = DMA::NONE;
     return true;
 }
@@ -51,7 +57,7 @@ bool Scheduler::submit_dma(uint32_t valid_cycle, defs::Opcode opcode, uint32_t v
 bool Scheduler::submit_sched(uint32_t valid_cycle, defs::Opcode opcode, uint32_t val1, uint32_t val2) {
     switch(opcode) {
         case vpu::defs::P_SCH_FNC:
-            return (dma_outstanding==0) && (blitter_outstanding==0);
+            return can_accept(opcode);
         default:
             std::cerr << "Scheduler error for opcode " << vpu::defs::opcode_to_string(opcode);
             std::cerr << " in sched pipe. ";
@@ -79,7 +85,7 @@ bool Scheduler::submit_blitter(uint32_t valid_cycle, defs::Opcode opcode, uint32
     }
 
     //TODO need to confirm if this is actually correct RE cycle execution, same for other pipes
-    if (dma_frontend_queue.size() >= vpu::defs::SCHEDULER_FRONTEND_QUEUE_SIZE) {
+    if (!can_accept(opcode)) {
         return false;
     }
 
@@ -90,14 +96,42 @@ bool Scheduler::submit_blitter(uint32_t valid_cycle, defs::Opcode opcode, uint32
     return true;
 }
 
+bool Scheduler::can_accept(defs::Opcode opcode) {
+    switch(opcode) {
+        //Only set up frontend state
+        case vpu::defs::P_DMA_DST_R:
+        case vpu::defs::P_DMA_SRC_R:
+        case vpu::defs::P_DMA_LEN_R:
+        case vpu::defs::P_BLI_COL_R:
+            return true;
+        case vpu::defs::P_SCH_FNC:
+            return std::ranges::all_of(dma_outstanding, [](uint32_t count){ return count == 0; })
+                && (blitter_outstanding==0);
+        //Blitter commands are limited by the DMA queues too
+        default:
+            return dma_channel_for_submit() != NO_CHANNEL;
+    }
+}
+
+//Ties go to the lowest channel, so a single stream of commands stays on channel 0 until it
+//backs up
+uint32_t Scheduler::dma_channel_for_submit() const {
+    uint32_t best = NO_CHANNEL;
+    for (uint32_t channel = 0; channel < dma_frontend_queues.size(); channel++) {
+        if (dma_frontend_queues[channel].size() >= vpu::defs::SCHEDULER_FRONTEND_QUEUE_SIZE) continue;
+        if (best == NO_CHANNEL || dma_outstanding[channel] < dma_outstanding[best]) best = channel;
+    }
+    return best;
+}
+
 void Scheduler::blitter_complete() {
     assert(blitter_outstanding > 0);
     blitter_outstanding--;
 }
 
-void Scheduler::dma_complete() {
-    assert(dma_outstanding > 0);
-    dma_outstanding--;
+void Scheduler::dma_complete(uint32_t channel) {
+    assert(dma_outstanding[channel] > 0);
+    dma_outstanding[channel]--;
 }
 
 bool Scheduler::core_submit(uint32_t valid_cycle, defs::Opcode opcode, uint32_t val1, uint32_t val2) {
@@ -117,7 +151,13 @@ bool Scheduler::core_submit(uint32_t valid_cycle, defs::Opcode opcode, uint32_t
 }
 
 void Scheduler::run_cycle() {
-    check_dma();
+    HOST_TIMER(SCHEDULER);
+    size_t dma_queued = 0;
+    for (auto& queue : dma_frontend_queues) dma_queued += queue.size();
+    dma_queue_occupancy.sample(dma_queued);
+    blitter_queue_occupancy.sample(blitter_frontend_queue.size());
+    for (uint32_t channel = 0; channel < dma_frontend_queues.size(); channel++)
+        check_dma(channel);
     check_blitter();
 }
 
@@ -141,16 +181,17 @@ void Scheduler::check_blitter() {
     }
 }
 
-void Scheduler::check_dma() {
+void Scheduler::check_dma(uint32_t channel) {
     //*** DMA ***//
+    auto& dma_frontend_queue = dma_frontend_queues[channel];
     //Nothing there
     if (!dma_frontend_queue.size()) return;
     //Can't run yet
     if (!dma_frontend_queue.front().can_run()) return;
 
-    //DMA can accept data
-    std::function<void()> callback = std::bind(&Scheduler::dma_complete, this);
-    if (dma.submit(dma_frontend_queue.front().data, callback)){
+    //DMA channel can accept data
+    std::function<void()> callback = std::bind(&Scheduler::dma_complete, this, channel);
+    if (dma.submit(channel, dma_frontend_queue.front().data, callback)){
         dma_frontend_queue.pop_front();
         return;
     }
@@ -162,4 +203,39 @@ void Scheduler::check_dma() {
 
 }
 
+template <typename Command>
+uint32_t Scheduler::frontend_event_cycle(std::deque<Defer<Command>>& queue, bool pipe_busy) {
+    if (!queue.size()) return NO_EVENT;
+    uint32_t cycle = queue.front().cycle;
+    if (cycle != vpu::defs::get_global_cycle())
+        return cycle > vpu::defs::get_global_cycle() ? cycle : NO_EVENT;
+    //Refused again every cycle until the pipe finishes, which is its own event
+    return pipe_busy ? NO_EVENT : cycle;
+}
+
+uint32_t Scheduler::next_event_cycle() {
+    uint32_t next = frontend_event_cycle(blitter_frontend_queue, blitter.busy());
+    for (uint32_t channel = 0; channel < dma_frontend_queues.size(); channel++)
+        next = std::min(next, frontend_event_cycle(dma_frontend_queues[channel], dma.busy(channel)));
+    return next;
+}
+
+void Scheduler::skip_cycles(uint32_t cycles) {
+    size_t dma_queued = 0;
+    for (auto& queue : dma_frontend_queues) dma_queued += queue.size();
+    dma_queue_occupancy.sample(dma_queued, cycles);
+    blitter_queue_occupancy.sample(blitter_frontend_queue.size(), cycles);
+    //A command that is due is being refused, the queue waits behind it
+    for (auto& queue : dma_frontend_queues)
+        if (queue.size() && queue.front().can_run())
+            for (auto& cmd : queue) cmd.increment(cycles);
+    if (blitter_frontend_queue.size() && blitter_frontend_queue.front().can_run())
+        for (auto& cmd : blitter_frontend_queue) cmd.increment(cycles);
+}
+
+void Scheduler::register_counters(vpu::stats::Registry& registry) {
+    registry.histogram("scheduler", "dma_queue_occupancy", dma_queue_occupancy, "DMA commands waiting each cycle");
+    registry.histogram("scheduler", "blitter_queue_occupancy", blitter_queue_occupancy, "Blitter commands waiting each cycle");
+}
+
 }
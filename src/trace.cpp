@@ -0,0 +1,145 @@
+#include "trace.h"
+#include <assert.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace vpu::trace {
+
+std::string pipeline_heading() {
+    std::array<std::string, STAGE_COUNT> headers = {"FETCH","DECODE","EXECUTE","MEMORY","WRITEBACK"};
+
+    std::string op = "|";
+    for (auto& h : headers){
+        op += " ";
+        h.insert(0, vpu::defs::MAX_OPCODE_LEN - h.size(), ' ');
+        op += h;
+        op += " |";
+    }
+
+    return op;
+}
+
+std::string pipeline_string(const PipelineStatus& stages) {
+    std::string op;
+    std::string na(vpu::defs::MAX_OPCODE_LEN, '-');
+    op += "|";
+    for (auto& status : stages) {
+        op += " ";
+        op += status.valid ? vpu::defs::opcode_to_string_fixed(status.opcode) : na;
+        op += " |";
+    }
+
+    return op;
+}
+
+std::string registers_string(std::span<const uint32_t> registers, std::span<const bool> flags) {
+    std::string op;
+    op.reserve(256);
+    char number[16];
+    for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++){
+        op += vpu::defs::register_to_string((vpu::defs::Register)i);
+        op += " ";
+        op.append(number, std::to_chars(number, number + sizeof(number), registers[i]).ptr);
+        op += " \t";
+    }
+    for (int i = 0; i < vpu::defs::FLAG_COUNT; i++){
+        op += vpu::defs::flag_to_string((vpu::defs::Flag)i);
+        op += flags[i] ? " 1 \t" : " 0 \t";
+    }
+    return op;
+}
+
+static uint8_t pack_flags(std::span<const bool> flags) {
+    uint8_t packed = 0;
+    for (int i = 0; i < vpu::defs::FLAG_COUNT; i++)
+        packed |= flags[i] << i;
+    return packed;
+}
+
+TraceWriter::TraceWriter(const std::string& path, uint64_t capacity,
+                         std::span<const uint32_t> registers, std::span<const bool> flags) {
+    assert(capacity > 0);
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to open " << path << " for writing: " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+    if (capacity > (std::numeric_limits<off_t>::max() - sizeof(TraceHeader)) / sizeof(TraceRecord)) {
+        std::cerr << "Trace ring of " << capacity << " records is larger than a file can be" << std::endl;
+        exit(1);
+    }
+    mapped_size = sizeof(TraceHeader) + capacity * sizeof(TraceRecord);
+    if (ftruncate(fd, mapped_size) != 0) {
+        std::cerr << "Failed to size trace file " << path << ": " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+    void* mapping = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map trace file " << path << ": " << std::strerror(errno) << std::endl;
+        exit(1);
+    }
+    header = (TraceHeader*)mapping;
+    records = (TraceRecord*)((uint8_t*)mapping + sizeof(TraceHeader));
+
+    *header = TraceHeader{};
+    header->magic = TRACE_MAGIC;
+    header->version = TRACE_VERSION;
+    header->record_size = sizeof(TraceRecord);
+    header->register_count = vpu::defs::REGISTER_COUNT;
+    header->flag_count = vpu::defs::FLAG_COUNT;
+    header->stage_count = STAGE_COUNT;
+    header->capacity = capacity;
+    header->written = 0;
+    for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++)
+        header->base_registers[i] = last_registers[i] = registers[i];
+    header->base_flags = pack_flags(flags);
+}
+
+TraceWriter::~TraceWriter() {
+    uint64_t used = std::min(header->written, header->capacity);
+    munmap(header, mapped_size);
+    //Trim the unused tail of a ring that never wrapped
+    if (ftruncate(fd, sizeof(TraceHeader) + used * sizeof(TraceRecord)) != 0)
+        std::cerr << "Failed to trim trace file: " << std::strerror(errno) << std::endl;
+    close(fd);
+}
+
+void TraceWriter::record(uint32_t cycle, std::span<const uint32_t> registers, std::span<const bool> flags,
+                         const PipelineStatus& stages) {
+    TraceRecord& record = records[header->written % header->capacity];
+
+    //Fold the record being overwritten into the base state
+    if (header->written >= header->capacity) {
+        for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++)
+            if (record.changed & (1 << i)) header->base_registers[i] = record.registers[i];
+        //The PC is not in the changed mask, it is stored in every record
+        header->base_registers[vpu::defs::PC] = record.pc;
+        header->base_flags = record.flags;
+    }
+
+    record.cycle = cycle;
+    record.pc = registers[vpu::defs::PC];
+    record.flags = pack_flags(flags);
+    record.stage_valid = 0;
+    for (size_t s = 0; s < STAGE_COUNT; s++) {
+        record.stage_valid |= stages[s].valid << s;
+        record.opcodes[s] = stages[s].opcode;
+    }
+    //The PC has its own field and changes nearly every cycle
+    record.changed = 0;
+    for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++) {
+        if (i == vpu::defs::PC || registers[i] == last_registers[i]) continue;
+        record.changed |= 1 << i;
+        record.registers[i] = last_registers[i] = registers[i];
+    }
+
+    header->written++;
+}
+
+}
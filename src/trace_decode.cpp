@@ -0,0 +1,113 @@
+#include <array>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "defs_pkg.h"
+#include "trace.h"
+
+//Replay a --trace_file ring as the text layout of --pipeline/--trace, or as CSV
+int main(int argc, char *argv[]) {
+    bool pipeline = false;
+    bool trace = false;
+    bool csv = false;
+    const char* path = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!std::strcmp(argv[i], "--pipeline") || !std::strcmp(argv[i], "-p")) pipeline = true;
+        else if (!std::strcmp(argv[i], "--trace") || !std::strcmp(argv[i], "-t")) trace = true;
+        else if (!std::strcmp(argv[i], "--csv") || !std::strcmp(argv[i], "-c")) csv = true;
+        else if (!path && argv[i][0] != '-') path = argv[i];
+        else path = nullptr, i = argc;
+    }
+    if (!path) {
+        std::cerr << "Usage: " << argv[0] << " <trace file> [--pipeline] [--trace] [--csv]" << std::endl;
+        std::cerr << "Prints the register trace by default, --pipeline adds or selects the stage opcodes" << std::endl;
+        return 1;
+    }
+    if (!pipeline) trace = true;
+
+    std::ifstream input(path, std::ios::in | std::ios::binary);
+    if (!input.is_open()) {
+        std::cerr << "Failed to open " << path << " for reading." << std::endl;
+        return 1;
+    }
+
+    vpu::trace::TraceHeader header;
+    if (!input.read((char*)&header, sizeof(header)) || header.magic != vpu::trace::TRACE_MAGIC) {
+        std::cerr << "Error: " << path << " is not a trace file." << std::endl;
+        return 1;
+    }
+    if (header.version != vpu::trace::TRACE_VERSION
+        || header.record_size != sizeof(vpu::trace::TraceRecord)
+        || header.register_count != vpu::defs::REGISTER_COUNT
+        || header.flag_count != vpu::defs::FLAG_COUNT
+        || header.stage_count != vpu::trace::STAGE_COUNT) {
+        std::cerr << "Error: " << path << " was written by a different version of the simulator." << std::endl;
+        return 1;
+    }
+
+    uint64_t count = std::min(header.written, header.capacity);
+    std::vector<vpu::trace::TraceRecord> records(count);
+    if (!input.read((char*)records.data(), count * sizeof(vpu::trace::TraceRecord))) {
+        std::cerr << "Error: trace is truncated." << std::endl;
+        return 1;
+    }
+    //Once wrapped the oldest record is the next one to be overwritten
+    uint64_t first = header.written > header.capacity ? header.written % header.capacity : 0;
+
+    std::array<uint32_t,vpu::defs::REGISTER_COUNT> registers;
+    std::array<bool,vpu::defs::FLAG_COUNT> flags;
+    vpu::trace::PipelineStatus stages;
+    for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++) registers[i] = header.base_registers[i];
+    for (int i = 0; i < vpu::defs::FLAG_COUNT; i++) flags[i] = header.base_flags & (1 << i);
+
+    if (csv) {
+        std::cout << "cycle";
+        for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++)
+            std::cout << "," << vpu::defs::register_to_string((vpu::defs::Register)i);
+        for (int i = 0; i < vpu::defs::FLAG_COUNT; i++)
+            std::cout << "," << vpu::defs::flag_to_string((vpu::defs::Flag)i);
+        std::cout << ",fetch,decode,execute,memory,writeback\n";
+    } else {
+        std::cout << "           ";
+        if (pipeline)
+            std::cout << "\t" << vpu::trace::pipeline_heading();
+        if (trace)
+            std::cout << "\t" << vpu::trace::registers_string(registers, flags);
+        std::cout << "\n";
+    }
+
+    for (uint64_t n = 0; n < count; n++) {
+        auto& record = records[(first + n) % header.capacity];
+        registers[vpu::defs::PC] = record.pc;
+        for (int i = 0; i < vpu::defs::REGISTER_COUNT; i++)
+            if (record.changed & (1 << i)) registers[i] = record.registers[i];
+        for (int i = 0; i < vpu::defs::FLAG_COUNT; i++)
+            flags[i] = record.flags & (1 << i);
+        for (size_t s = 0; s < vpu::trace::STAGE_COUNT; s++)
+            stages[s] = {(bool)(record.stage_valid & (1 << s)), (vpu::defs::Opcode)record.opcodes[s]};
+
+        if (csv) {
+            std::cout << record.cycle;
+            for (auto value : registers) std::cout << "," << value;
+            for (auto flag : flags) std::cout << "," << flag;
+            for (auto& stage : stages) {
+                std::cout << ",";
+                if (stage.valid) std::cout << vpu::defs::opcode_to_string(stage.opcode);
+            }
+            std::cout << "\n";
+            continue;
+        }
+
+        std::cout << "Cycle: " << record.cycle << "  ";
+        if (pipeline)
+            std::cout << "\t" << vpu::trace::pipeline_string(stages);
+        if (trace)
+            std::cout << "\t" << vpu::trace::registers_string(registers, flags);
+        std::cout << "\n";
+    }
+
+    return 0;
+}
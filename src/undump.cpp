@@ -0,0 +1,83 @@
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#include "dump_codec.h"
+
+namespace fs = std::filesystem;
+
+//Expand a sparse dump from --dump_mem_compress back to the raw layout of --dump_mem
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <sparse dump> <raw output>" << std::endl;
+        return 1;
+    }
+
+    std::ifstream input(argv[1], std::ios::in | std::ios::binary);
+    if (!input.is_open()) {
+        std::cerr << "Failed to open " << argv[1] << " for reading." << std::endl;
+        return 1;
+    }
+
+    vpu::dump::SparseHeader header;
+    if (!input.read((char*)&header, sizeof(header)) || header.magic != vpu::dump::SPARSE_MAGIC) {
+        std::cerr << "Error: " << argv[1] << " is not a sparse memory dump." << std::endl;
+        return 1;
+    }
+    if (header.version != vpu::dump::SPARSE_VERSION) {
+        std::cerr << "Error: unsupported sparse dump version " << header.version << std::endl;
+        return 1;
+    }
+
+    //Pages that are not written stay as holes in the file and read back as zero
+    {
+        std::ofstream create(argv[2], std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!create.is_open()) {
+            std::cerr << "Failed to open " << argv[2] << " for writing." << std::endl;
+            return 1;
+        }
+    }
+    fs::resize_file(argv[2], header.mem_size);
+    std::fstream output(argv[2], std::ios::in | std::ios::out | std::ios::binary);
+
+    std::vector<uint8_t> encoded;
+    std::vector<uint8_t> page(header.page_size);
+    vpu::dump::PageHeader page_header;
+    while (input.read((char*)&page_header, sizeof(page_header))) {
+        uint64_t page_addr = (uint64_t)page_header.index * header.page_size;
+        if (page_header.index >= header.page_count || page_addr >= header.mem_size) {
+            std::cerr << "Error: page " << page_header.index << " is outside of memory." << std::endl;
+            return 1;
+        }
+        size_t page_length = std::min<uint64_t>(header.page_size, header.mem_size - page_addr);
+
+        encoded.resize(page_header.length);
+        if (!input.read((char*)encoded.data(), encoded.size())) {
+            std::cerr << "Error: dump is truncated in page " << page_header.index << std::endl;
+            return 1;
+        }
+
+        bool valid;
+        if (page_header.flags & vpu::dump::PAGE_RAW) {
+            valid = encoded.size() == page_length;
+            std::memcpy(page.data(), encoded.data(), std::min(encoded.size(), page_length));
+        } else {
+            valid = vpu::dump::decompress(encoded, std::span<uint8_t>(page.data(), page_length));
+        }
+        if (!valid) {
+            std::cerr << "Error: page " << page_header.index << " is corrupt." << std::endl;
+            return 1;
+        }
+
+        output.seekp(page_addr);
+        output.write((char*)page.data(), page_length);
+    }
+
+    if (!input.eof() || input.gcount() != 0) {
+        std::cerr << "Error: dump ends in the middle of a page record." << std::endl;
+        return 1;
+    }
+    return 0;
+}
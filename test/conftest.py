@@ -3,7 +3,7 @@ from VPU_ASM.instructions import ISADefinition, load_from_yaml
 from VPU_ASM.assembler import Program, write_out
 from pathlib import Path
 from subprocess import run
-from util import RegState
+from util import RegState, RangeMemory, write_sectioned
 
 PROGS = Path("VPU_ASM/test_programs")
 BINS = Path("test/binaries")
@@ -17,7 +17,7 @@ def isa():
 
 @pytest.fixture
 def run_program(isa, request, clean):
-    prog, regs, mem = request.param
+    prog, regs, mem, *flags = request.param
     inp = PROGS / (prog + ".asm")
     bin = BINS / (prog + ".out")
     dump_reg = DUMP / (prog + ".reg")
@@ -32,6 +32,13 @@ def run_program(isa, request, clean):
         cmd += f" --dump_regs {dump_reg}"
     if mem:
         cmd += f" --dump_mem {dump_mem}"
+        #A list of (address, length) restricts the dump to those ranges
+        if mem is not True:
+            for addr, length in mem:
+                cmd += f" --dump_mem_range {addr:#x}:{length:#x}"
+    #Any further parameters are passed through as extra flags
+    for flag in flags:
+        cmd += f" {flag}"
     proc = run(cmd, timeout=5, shell=True)
 
     assert proc.returncode == 0
@@ -46,6 +53,59 @@ def run_program(isa, request, clean):
         dump_reg.unlink(missing_ok=True)
         dump_mem.unlink(missing_ok=True)
 
+@pytest.fixture
+def run_vpu(isa, clean):
+    """Returns a function that runs a test program, or an already built binary, under a new name.
+    Each keyword names a flag taking an output file and gives its suffix, so stats_json=".json"
+    passes --stats_json test/dumps/<name>.json. Further arguments are passed through as flags.
+    The function returns the output paths by flag and the completed process."""
+    created = []
+    def run_with(prog, name, *flags, **outputs):
+        if isinstance(prog, Path):
+            bin = prog
+        else:
+            bin = BINS / (name + ".out")
+            write_out(Program(PROGS / (prog + ".asm"), isa), bin)
+            created.append(bin)
+        paths = {flag: DUMP / (name + suffix) for flag, suffix in outputs.items()}
+        created.extend(paths.values())
+
+        cmd = f"build/vpu {bin}"
+        for flag, path in paths.items():
+            cmd += f" --{flag} {path}"
+        for flag in flags:
+            cmd += f" {flag}"
+        proc = run(cmd, timeout=5, shell=True, capture_output=True, text=True)
+        assert proc.returncode == 0, proc.stderr
+        return paths, proc
+
+    yield run_with
+    if clean:
+        for path in created:
+            path.unlink(missing_ok=True)
+
+@pytest.fixture
+def assemble(isa, clean):
+    """Returns a function that assembles program text under a name and returns the binary.
+    Given (address, data) segments it writes a sectioned binary with the program at address 0
+    followed by those segments. Everything it writes is removed afterwards."""
+    created = []
+    def assemble_as(name, source, segments=()):
+        asm = BINS / (name + ".asm")
+        flat = BINS / (name + ".flat")
+        bin = BINS / (name + ".out")
+        created.extend((asm, flat, bin))
+        asm.write_text(source)
+        write_out(Program(asm, isa), flat if segments else bin)
+        if segments:
+            write_sectioned(bin, [(0, flat.read_bytes()), *segments])
+        return bin
+
+    yield assemble_as
+    if clean:
+        for path in created:
+            path.unlink(missing_ok=True)
+
 @pytest.fixture
 def actual_registers(request):
     prog = request.param
@@ -60,12 +120,11 @@ def actual_registers(request):
 
 @pytest.fixture
 def actual_memory(request):
-    prog = request.param
+    prog, ranges = request.param
     dump = DUMP / (prog + ".mem")
-    v = {}
     with dump.open('rb') as f:
         data = f.read()
-    yield data
+    yield RangeMemory(ranges, data)
 
 def pytest_addoption(parser):
     parser.addoption("--no_clean", action="store_true")
@@ -1,5 +1,7 @@
+import json
 import pytest
-from pathlib import Path
+import re
+from subprocess import run
 from util import RegState
 
 TEST_FILES = [
@@ -31,4 +33,103 @@ def expected_registers(request):
     indirect=True
 )
 def test_register_state(run_program,actual_registers,expected_registers):
-    assert actual_registers == expected_registers
\ No newline at end of file
+    assert actual_registers == expected_registers
+
+@pytest.mark.parametrize(
+    "run_program, actual_registers, expected_registers",
+    [((p,True,False,"--functional"),p,p) for p in TEST_FILES],
+    indirect=True
+)
+def test_register_state_functional(run_program,actual_registers,expected_registers):
+    assert actual_registers == expected_registers
+
+cycle_lines = lambda out: [line for line in out.splitlines() if line.startswith("Cycle:")]
+
+@pytest.fixture
+def trace_outputs(run_vpu, request):
+    #A ring size of 0 keeps the default, which holds every cycle
+    prog, ring = request.param
+    _, text = run_vpu(prog, prog + "_text", "--pipeline --trace")
+    out, _ = run_vpu(prog, prog + "_trace", f"--trace_ring {ring}" if ring else "", trace_file=".trace")
+    decoded = run(f"build/vpu_trace {out['trace_file']} --pipeline --trace", timeout=5, shell=True, capture_output=True, text=True)
+    assert decoded.returncode == 0
+    yield text.stdout, decoded.stdout
+
+@pytest.mark.parametrize("trace_outputs", [("branch", 0), ("jump", 0)], indirect=True)
+def test_binary_trace_matches_text(trace_outputs):
+    text, decoded = trace_outputs
+    assert len(cycle_lines(text)) > 0
+    assert cycle_lines(decoded) == cycle_lines(text)
+
+@pytest.mark.parametrize("trace_outputs", [("branch", 8), ("jump", 8)], indirect=True)
+def test_wrapped_trace_matches_text_tail(trace_outputs):
+    #Overwritten records are folded into the base state, so the kept cycles still decode exactly
+    text, decoded = trace_outputs
+    assert len(cycle_lines(text)) > 8
+    assert cycle_lines(decoded) == cycle_lines(text)[-8:]
+    #The heading line shows the base state, which is the last cycle overwritten
+    registers = lambda line: line.rsplit("|", 1)[1]
+    assert registers(decoded.splitlines()[0]) == registers(cycle_lines(text)[-9])
+
+
+@pytest.fixture
+def folded_profile(run_vpu, request):
+    prog = request.param
+    out, _ = run_vpu(prog, prog + "_profile", profile_folded=".folded", stats_json=".json")
+    yield out["profile_folded"].read_text(), json.loads(out["stats_json"].read_text())
+
+@pytest.mark.parametrize("folded_profile", ["branch", "jump"], indirect=True)
+def test_profile_covers_every_cycle(folded_profile):
+    folded, stats = folded_profile
+    total = 0
+    for line in folded.splitlines():
+        stack, count = line.rsplit(" ", 1)
+        assert len(stack.split(";")) == 3
+        total += int(count)
+    assert total == stats["core"]["cycles"]
+
+@pytest.fixture
+def pipeview_log(run_vpu, request):
+    prog = request.param
+    out, _ = run_vpu(prog, prog + "_pipeview", pipeview=".kanata", stats_json=".json")
+    yield out["pipeview"].read_text(), json.loads(out["stats_json"].read_text())
+
+@pytest.mark.parametrize("pipeview_log", ["branch", "jump"], indirect=True)
+def test_pipeview_retires_every_instruction(pipeview_log):
+    log, stats = pipeview_log
+    lines = [line.split("\t") for line in log.splitlines()]
+    assert lines[0] == ["Kanata", "0004"]
+    fetched = {line[1] for line in lines if line[0] == "I"}
+    retired = [line[1] for line in lines if line[0] == "R" and line[3] == "0"]
+    flushed = [line[1] for line in lines if line[0] == "R" and line[3] == "1"]
+    assert len(retired) == stats["core"]["retired_instructions"]
+    assert sorted(retired + flushed) == sorted(fetched)
+
+OUTPUT_LOOP_PROGRAM = """
+MOV_I24 0
+MOV_R_I16 R1, 0x4000
+loop:
+ADD_I24 1
+CMP_R_R R1, ACC
+BRA_L done
+JMP_L loop
+done:
+HLT
+"""
+
+def test_output_policies(assemble, run_vpu):
+    bin = assemble("output_loop", OUTPUT_LOOP_PROGRAM)
+    flags = "--pipeline --trace --output_buffer 1"
+
+    #Everything is written out at exit, up to the last cycle and including the last partial chunk
+    out, block = run_vpu(bin, "output_loop", flags, stats_json=".json")
+    cycles = [int(line.split()[1]) for line in block.stdout.splitlines() if line.startswith("Cycle:")]
+    assert cycles == list(range(1, json.loads(out["stats_json"].read_text())["core"]["cycles"] + 1))
+
+    #Dropping keeps the rest of the output in order and in whole lines, and counts what it lost.
+    #The same output names keep the other messages on stdout the same.
+    _, drop = run_vpu(bin, "output_loop", flags, "--output_policy drop", stats_json=".json")
+    kept = iter(block.stdout.splitlines())
+    assert all(line in kept for line in drop.stdout.splitlines())
+    dropped = re.search(r"dropped (\d+) bytes", drop.stderr)
+    assert len(block.stdout) - len(drop.stdout) == (int(dropped[1]) if dropped else 0)
@@ -0,0 +1,92 @@
+import pytest
+import struct
+from pathlib import Path
+from subprocess import run
+from util import write_sectioned, RangeMemory
+
+PROGS = Path("VPU_ASM/test_programs")
+BINS = Path("test/binaries")
+
+FRAMEBUFFER_ADDR = 0x1FFC0000
+
+def test_sectioned_program(assemble, run_vpu):
+    nops = (PROGS / "nops.asm").read_text()
+    code = assemble("nops_flat", nops).read_bytes()
+    data = bytes(range(256)) * 4
+    sectioned = assemble("nops_sectioned", nops, [
+        (FRAMEBUFFER_ADDR, data),
+        (FRAMEBUFFER_ADDR + 0x100, 0x100), #zero fill over part of the data
+    ])
+
+    ranges = [(0, len(code) + 0x1000), (FRAMEBUFFER_ADDR, len(data))]
+    dump_ranges = " ".join(f"--dump_mem_range {addr:#x}:{length:#x}" for addr, length in ranges)
+    out, _ = run_vpu(sectioned, "nops_sectioned", dump_ranges, dump_regs=".reg", dump_mem=".mem")
+
+    regs = dict(line.split() for line in out["dump_regs"].read_text().splitlines())
+    assert int(regs["PC"]) == 0x10
+
+    memory = RangeMemory(ranges, out["dump_mem"].read_bytes())
+    read = lambda addr, length: bytes(memory[a] for a in range(addr, addr+length))
+    assert read(0, len(code)) == code
+    assert read(len(code), 0x1000) == bytes(0x1000)
+    assert read(FRAMEBUFFER_ADDR, 0x100) == data[:0x100]
+    assert read(FRAMEBUFFER_ADDR+0x100, 0x100) == bytes(0x100)
+    assert read(FRAMEBUFFER_ADDR+0x200, len(data)-0x200) == data[0x200:]
+
+def test_sectioned_segment_count_checked(clean):
+    #A segment count far beyond the file is reported, not allocated
+    sectioned = BINS / "bad_count.out"
+    sectioned.write_bytes(b"VPUS" + struct.pack("<I", 0xFFFFFFFF))
+    proc = run(f"build/vpu {sectioned}", timeout=5, shell=True, capture_output=True, text=True)
+    assert proc.returncode == 1
+    assert "truncated segment table" in proc.stderr
+
+    if clean:
+        sectioned.unlink(missing_ok=True)
+
+#A DMA set over the boundary between the second and third 64KiB pages
+PAGES_PROGRAM = """
+MOV_I24 0x1FFE0
+MOV_R_R R1, ACC
+MOV_R_I16 R2, 0x40
+MOV_R_I16 R3, 0x5A
+P_DMA_DST_R R1
+P_DMA_LEN_R R2
+P_DMA_SET_R R3
+P_SCH_FNC
+HLT
+"""
+
+def test_memory_pages(assemble, run_vpu):
+    data = bytes(range(256))
+    #A loaded segment over the boundary between the third and fourth pages
+    sectioned = assemble("pages", PAGES_PROGRAM, [(0x2FF80, data)])
+
+    ranges = [(0x1FF00, 0x200), (0x2FF00, 0x200), (0x800000, 0x20000), (FRAMEBUFFER_ADDR, 0x1000)]
+    dump_ranges = " ".join(f"--dump_mem_range {addr:#x}:{length:#x}" for addr, length in ranges)
+    out, _ = run_vpu(sectioned, "pages", dump_ranges, dump_mem=".mem")
+
+    memory = RangeMemory(ranges, out["dump_mem"].read_bytes())
+    read = lambda addr, length: bytes(memory[a] for a in range(addr, addr+length))
+    assert read(0x1FF00, 0x200) == bytes(0xE0) + b"\x5A" * 0x40 + bytes(0xE0)
+    assert read(0x2FF00, 0x200) == bytes(0x80) + data + bytes(0x80)
+    #Pages nothing touched read as zero
+    assert read(0x800000, 0x20000) == bytes(0x20000)
+    assert read(FRAMEBUFFER_ADDR, 0x1000) == bytes(0x1000)
+
+def test_oversized_programs_rejected(clean):
+    #Sparse, so no larger than any memory size without taking up the space
+    flat = BINS / "oversized.out"
+    with flat.open("wb") as f:
+        f.truncate(1 << 33)
+    sectioned = BINS / "oversized_segment.out"
+    write_sectioned(sectioned, [(0xFFFFFF00, bytes(0x200))])
+
+    for bin, message in ((flat, "larger than the"), (sectioned, "extends beyond the end of memory")):
+        proc = run(f"build/vpu {bin}", timeout=5, shell=True, capture_output=True, text=True)
+        assert proc.returncode == 1
+        assert message in proc.stderr
+
+    if clean:
+        for path in (flat, sectioned):
+            path.unlink(missing_ok=True)
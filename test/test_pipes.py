@@ -1,16 +1,29 @@
+import json
 import pytest
+import struct
 from pathlib import Path
-from util import RegState
+from subprocess import run
+from util import RegState, RangeMemory, fnv1a
 
 TEST_FILES = [
     "dma_copy",
     "dma_set",
 ]
 
-def params(prog):
-    return [((prog,False,True),prog)]
+#Constants that may change with config, currently no easy way to extract them
+FRAMEBUFFER_BYTES = 300 * 200 * 4
+FRAMEBUFFER_ADDR = 0x1FFC0000
 
-@pytest.mark.parametrize("run_program, actual_memory", params("dma_set"), indirect=True)
+DMA_SET_RANGES = [(0xF00000-1, 0x10002)]
+DMA_COPY_RANGES = [(0xF00000-1, 0x10002), (0xF70000-1, 0x10002)]
+FRAMEBUFFER_RANGES = [(FRAMEBUFFER_ADDR, FRAMEBUFFER_BYTES)]
+
+DUMP = Path("test/dumps")
+
+def params(prog, ranges):
+    return [((prog,False,ranges),(prog,ranges))]
+
+@pytest.mark.parametrize("run_program, actual_memory", params("dma_set", DMA_SET_RANGES), indirect=True)
 def test_dma_set(run_program,actual_memory):
     base = 0xF00000
     length = 0x10000
@@ -19,7 +32,92 @@ def test_dma_set(run_program,actual_memory):
         assert actual_memory[base+offset] == 0xFF
     assert actual_memory[base+length] == 0
 
-@pytest.mark.parametrize("run_program, actual_memory", params("dma_copy"), indirect=True)
+@pytest.fixture
+def dma_set_digest(run_vpu):
+    out, _ = run_vpu("dma_set", "dma_set_digest", "--dump_mem_digest --dump_mem_range 0xF00000:0x10000", dump_mem=".txt")
+    yield out["dump_mem"].read_text()
+
+def test_dma_set_digest(dma_set_digest):
+    addr, length, digest = dma_set_digest.split()
+    assert int(addr, 16) == 0xF00000
+    assert int(length, 16) == 0x10000
+    assert int(digest, 16) == fnv1a(b"\xff" * 0x10000)
+
+@pytest.fixture
+def dma_set_compressed(run_vpu, clean):
+    out, _ = run_vpu("dma_set", "dma_set_compressed", "--dump_mem_compress", dump_mem=".vpuz")
+    dump = out["dump_mem"]
+    raw = DUMP / "dma_set_compressed.mem"
+    proc = run(f"build/vpu_undump {dump} {raw}", timeout=5, shell=True)
+    assert proc.returncode == 0
+    yield dump, raw
+    if clean:
+        raw.unlink(missing_ok=True)
+
+def test_dma_set_compressed(dma_set_compressed):
+    dump, raw = dma_set_compressed
+    assert dump.stat().st_size < 0x10000
+    base = 0xF00000
+    length = 0x10000
+    with raw.open('rb') as f:
+        f.seek(base-1)
+        data = f.read(length+2)
+    assert data == b"\x00" + b"\xff" * length + b"\x00"
+
+@pytest.fixture
+def dma_set_stats(run_vpu):
+    out, _ = run_vpu("dma_set", "dma_set_stats", stats_json=".json")
+    yield json.loads(out["stats_json"].read_text())
+
+def test_dma_set_stats(dma_set_stats):
+    core = dma_set_stats["core"]
+    assert core["retired_instructions"] > 0
+    assert core["cycles"] >= core["retired_instructions"]
+    assert dma_set_stats["dma"]["bytes_moved"] == 0x10000
+    assert dma_set_stats["dma"]["busy_cycles"] >= 0x10000 // 64
+    assert sum(dma_set_stats["scheduler"]["dma_queue_occupancy"]) == core["cycles"]
+
+#No HLT, the end of the program is reached while the core waits on the fence
+DMA_FENCE_AT_END_PROGRAM = """
+MOV_I24 0x100000
+MOV_R_R R1, ACC
+MOV_I24 0x8000
+MOV_R_R R2, ACC
+MOV_R_I16 R3, 0x5A
+P_DMA_DST_R R1
+P_DMA_LEN_R R2
+P_DMA_SET_R R3
+P_SCH_FNC
+"""
+
+#The core waits on the fence for the whole clear
+BLITTER_CLEAR_FENCE_PROGRAM = """
+MOV_R_I16 R1, 0x1234
+P_BLI_COL_R R1
+P_BLI_CLR
+P_SCH_FNC
+MOV_R_I16 R2, 7
+HLT
+"""
+
+@pytest.fixture
+def skipped_and_ticked_stats(run_vpu, assemble, request):
+    name, source = request.param
+    prog = assemble(name, source) if source else name
+    skipped, _ = run_vpu(prog, name + "_skipped", "--dump_mem_digest", stats_json=".json", dump_mem=".digest")
+    #A trace file needs every cycle and every DMA line, so this run never skips any
+    ticked, _ = run_vpu(prog, name + "_ticked", "--dump_mem_digest --trace_ring 16", stats_json=".json", dump_mem=".digest", trace_file=".trace")
+    read = lambda out: (json.loads(out["stats_json"].read_text()), out["dump_mem"].read_text())
+    yield read(skipped), read(ticked)
+
+@pytest.mark.parametrize("skipped_and_ticked_stats", [("dma_set", None), ("dma_copy", None),
+                         ("dma_fence_at_end", DMA_FENCE_AT_END_PROGRAM),
+                         ("blitter_clear_fence", BLITTER_CLEAR_FENCE_PROGRAM)], indirect=True)
+def test_skipping_is_cycle_identical(skipped_and_ticked_stats):
+    skipped, ticked = skipped_and_ticked_stats
+    assert skipped == ticked
+
+@pytest.mark.parametrize("run_program, actual_memory", params("dma_copy", DMA_COPY_RANGES), indirect=True)
 def test_dma_copy(run_program,actual_memory):
     base = 0xF00000
     length = 0x10000
@@ -34,7 +132,7 @@ def test_dma_copy(run_program,actual_memory):
         assert actual_memory[base+offset] == 0xFF
     assert actual_memory[base+length] == 0
 
-@pytest.mark.parametrize("run_program, actual_memory", params("dma_copy"), indirect=True)
+@pytest.mark.parametrize("run_program, actual_memory", params("dma_copy", DMA_COPY_RANGES), indirect=True)
 def test_dma_copy(run_program,actual_memory):
     base = 0xF00000
     length = 0x10000
@@ -50,7 +148,7 @@ def test_dma_copy(run_program,actual_memory):
     assert actual_memory[base+length] == 0
 
 
-@pytest.mark.parametrize("run_program, actual_memory", params("blitter_pixel"), indirect=True)
+@pytest.mark.parametrize("run_program, actual_memory", params("blitter_pixel", FRAMEBUFFER_RANGES), indirect=True)
 def test_blit_pix(run_program,actual_memory):
     #Constants that may change with config, currently no easy way to extract them
     FRAMEBUFFER_WIDTH = 300
@@ -80,7 +178,7 @@ def test_blit_pix(run_program,actual_memory):
                 assert actual_memory[addr+3] == 0x0
 
 
-@pytest.mark.parametrize("run_program, actual_memory", params("blitter_clear"), indirect=True)
+@pytest.mark.parametrize("run_program, actual_memory", params("blitter_clear", FRAMEBUFFER_RANGES), indirect=True)
 def test_blit_clear(run_program,actual_memory):
     #Constants that may change with config, currently no easy way to extract them
     FRAMEBUFFER_WIDTH = 300
@@ -98,4 +196,310 @@ def test_blit_clear(run_program,actual_memory):
             assert actual_memory[addr+2] == 0xFF
             assert actual_memory[addr+3] == 0xFF
 
+def dma_descriptor(source, dest, length, operation, value, next, height=0, source_stride=0, dest_stride=0):
+    return struct.pack("<8I", source, dest, length, operation | (value << 8), next, height, source_stride, dest_stride)
+
+DMA_CHAIN_PROGRAM = """
+MOV_I24 0x10000
+MOV_R_R R1, ACC
+MOV_R_I16 R2, 0
+P_DMA_SRC_R R1
+P_DMA_LEN_R R2
+P_DMA_CPY
+P_SCH_FNC
+HLT
+"""
+
+@pytest.mark.parametrize("flags", ["", "--functional"])
+def test_dma_chain(assemble, run_vpu, flags):
+    data = bytes((i * 7 + 3) & 0xFF for i in range(0x200))
+    descriptors = (dma_descriptor(0x20000, 0x30003, 0x105, 1, 0, 0x10020)
+                 + dma_descriptor(0, 0x40000, 0x40, 2, 0x5A, 0x10040)
+                 + dma_descriptor(0x20100, 0x50000, 0x80, 1, 0, 0))
+    bin = assemble("dma_chain", DMA_CHAIN_PROGRAM, [(0x10000, descriptors), (0x20000, data)])
+
+    ranges = [(0x30000, 0x200), (0x40000, 0x80), (0x50000, 0x100)]
+    dump_ranges = " ".join(f"--dump_mem_range {addr:#x}:{length:#x}" for addr, length in ranges)
+    out, _ = run_vpu(bin, "dma_chain", flags, dump_ranges, dump_mem=".mem", stats_json=".json")
+
+    memory = RangeMemory(ranges, out["dump_mem"].read_bytes())
+    read = lambda addr, length: bytes(memory[a] for a in range(addr, addr+length))
+    assert read(0x30000, 3) == bytes(3)
+    assert read(0x30003, 0x105) == data[:0x105]
+    assert read(0x30108, 0xF8) == bytes(0xF8)
+    assert read(0x40000, 0x40) == b"\x5A" * 0x40
+    assert read(0x40040, 0x40) == bytes(0x40)
+    assert read(0x50000, 0x80) == data[0x100:0x180]
+    assert read(0x50080, 0x80) == bytes(0x80)
+    assert json.loads(out["stats_json"].read_text())["dma"]["descriptors"] == 3
+
+#The chain starts at 0x10000, each case follows on from a valid descriptor
+BAD_CHAINS = [
+    ("misaligned", dma_descriptor(0, 0x40000, 0x40, 2, 0x5A, 0x10010), "is not 32-byte aligned"),
+    ("operation", dma_descriptor(0, 0x40000, 0x40, 2, 0x5A, 0x10020) + dma_descriptor(0, 0x40000, 0x40, 3, 0, 0), "Invalid DMA operation 3"),
+    ("past_end", dma_descriptor(0, 0x40000, 0x40, 2, 0x5A, 0xFFFFFFE0), "is beyond the end of memory"),
+    ("source", dma_descriptor(0xFFFFFF00, 0x40000, 0x200, 1, 0, 0), "extends beyond the end of memory"),
+    ("dest_rows", dma_descriptor(0, 0x40000, 0x40, 2, 0x5A, 0, 0x10000, 0, 0x10000), "extends beyond the end of memory"),
+    ("loop", dma_descriptor(0, 0x40000, 0x40, 2, 0x5A, 0x10020) + dma_descriptor(0, 0x40040, 0, 2, 0x5A, 0x10000), "loops back to"),
+]
+
+@pytest.mark.parametrize("flags", ["", "--functional"])
+@pytest.mark.parametrize("name, descriptors, message", BAD_CHAINS, ids=[case[0] for case in BAD_CHAINS])
+def test_dma_chain_errors(assemble, flags, name, descriptors, message):
+    bin = assemble("dma_chain_" + name, DMA_CHAIN_PROGRAM, [(0x10000, descriptors)])
+    proc = run(f"build/vpu {bin} {flags}", timeout=5, shell=True, capture_output=True, text=True)
+    assert proc.returncode == 1
+    assert message in proc.stderr
+
+@pytest.mark.parametrize("flags", ["", "--functional"])
+def test_dma_2d(assemble, run_vpu, flags):
+    #A 40x8 pixel block from a 100 pixel wide image to pixel (5, 3) of the framebuffer
+    width, height, image_stride, frame_stride, x, y = 40 * 4, 8, 100 * 4, 300 * 4, 5 * 4, 3
+    image = bytes((i * 13 + 1) & 0xFF for i in range(image_stride * height))
+    dest = FRAMEBUFFER_ADDR + y * frame_stride + x
+    descriptors = dma_descriptor(0x20000, dest, width, 1, 0, 0, height, image_stride, frame_stride)
+    bin = assemble("dma_2d", DMA_CHAIN_PROGRAM, [(0x10000, descriptors), (0x20000, image)])
+
+    out, _ = run_vpu(bin, "dma_2d", flags, f"--dump_mem_range {FRAMEBUFFER_ADDR:#x}:{FRAMEBUFFER_BYTES:#x}", dump_mem=".mem")
+
+    frame = out["dump_mem"].read_bytes()
+    for row in range(y - 1, y + height + 1):
+        expected = bytearray(frame_stride)
+        if y <= row < y + height:
+            start = (row - y) * image_stride
+            expected[x:x+width] = image[start:start+width]
+        assert frame[row*frame_stride:(row+1)*frame_stride] == expected
+
+DMA_CHANNELS_PROGRAM = """
+MOV_I24 0x100000
+MOV_R_R R1, ACC
+MOV_I24 0x300000
+MOV_R_R R2, ACC
+MOV_I24 0x8000
+MOV_R_R R3, ACC
+MOV_R_I16 R4, 0x5A
+P_DMA_DST_R R1
+P_DMA_LEN_R R3
+P_DMA_SET_R R4
+P_DMA_DST_R R2
+P_DMA_SET_R R4
+P_SCH_FNC
+HLT
+"""
+
+def test_dma_channels(assemble, run_vpu):
+    bin = assemble("dma_channels", DMA_CHANNELS_PROGRAM)
+    results = {}
+    for channels in (1, 2):
+        out, _ = run_vpu(bin, f"dma_channels_{channels}", f"--dma_channels {channels}",
+                         "--dump_mem_range 0x100000:0x8000 --dump_mem_range 0x300000:0x8000",
+                         dump_mem=".mem", stats_json=".json")
+        assert out["dump_mem"].read_bytes() == b"\x5A" * 0x10000
+        results[channels] = json.loads(out["stats_json"].read_text())
+
+    #The two sets take turns on the memory port, which is busy either way, but the second no
+    #longer waits for the first to complete
+    one, two = results[1], results[2]
+    assert "dma_channel0" not in one
+    assert two["dma_channel0"]["bytes_moved"] == two["dma_channel1"]["bytes_moved"] == 0x8000
+    assert two["dma_channel0"]["wait_cycles"] > 0 and two["dma_channel1"]["wait_cycles"] > 0
+    assert two["core"]["cycles"] < one["core"]["cycles"]
+
+DMA_COPY_PROGRAM = """
+MOV_I24 0x100000
+MOV_R_R R1, ACC
+MOV_I24 0x200003
+MOV_R_R R2, ACC
+MOV_I24 0x4000
+MOV_R_R R3, ACC
+P_DMA_SRC_R R1
+P_DMA_DST_R R2
+P_DMA_LEN_R R3
+P_DMA_CPY
+P_SCH_FNC
+HLT
+"""
+
+def test_dma_read_latency(assemble, run_vpu):
+    data = bytes((i * 11 + 5) & 0xFF for i in range(0x4000))
+    bin = assemble("dma_latency", DMA_COPY_PROGRAM, [(0x100000, data)])
+
+    results = {}
+    for reads in (1, 4, 16):
+        out, _ = run_vpu(bin, f"dma_latency_{reads}", f"--dma_latency 8 --dma_reads {reads} --dump_mem_range 0x200003:0x4000",
+                         dump_mem=".mem", stats_json=".json")
+        assert out["dump_mem"].read_bytes() == data
+        results[reads] = json.loads(out["stats_json"].read_text())
+
+    #A single read waits out the whole latency for every line, reads in flight hide it
+    cycles = [results[reads]["core"]["cycles"] for reads in (1, 4, 16)]
+    waits = [results[reads]["dma"]["read_wait_cycles"] for reads in (1, 4, 16)]
+    assert cycles[0] > cycles[1] > cycles[2]
+    assert waits[0] > waits[1] > waits[2]
+    assert results[1]["dma"]["bytes_per_busy_cycle"] < results[16]["dma"]["bytes_per_busy_cycle"]
+
+DMA_UNALIGNED_SET_PROGRAM = """
+MOV_I24 0x100005
+MOV_R_R R1, ACC
+MOV_R_I16 R2, 0x83
+MOV_I24 0x100145
+MOV_R_R R3, ACC
+MOV_R_I16 R4, 0x10
+MOV_R_I16 R5, 0x5A
+P_DMA_DST_R R1
+P_DMA_LEN_R R2
+P_DMA_SET_R R5
+P_DMA_DST_R R3
+P_DMA_LEN_R R4
+P_DMA_SET_R R5
+P_SCH_FNC
+HLT
+"""
+
+@pytest.mark.parametrize("flags", ["", "--functional"])
+def test_dma_set_unaligned(assemble, run_vpu, flags):
+    #Neither set starts or ends on a line, the second sits inside one line
+    data = bytes((i * 5 + 1) & 0xFF for i in range(0x200))
+    bin = assemble("dma_unaligned", DMA_UNALIGNED_SET_PROGRAM, [(0x100000, data)])
+
+    out, _ = run_vpu(bin, "dma_unaligned", flags, "--dump_mem_range 0x100000:0x200", dump_mem=".mem")
+    expected = bytearray(data)
+    expected[0x5:0x88] = b"\x5A" * 0x83
+    expected[0x145:0x155] = b"\x5A" * 0x10
+    assert out["dump_mem"].read_bytes() == expected
+
+@pytest.mark.parametrize("prog", ["dma_set", "dma_copy"])
+def test_dense_memory_matches_paged(run_vpu, prog):
+    #A digest of the whole memory, untouched pages included
+    paged, _ = run_vpu(prog, prog + "_paged", "--dump_mem_digest", dump_mem=".digest")
+    dense, proc = run_vpu(prog, prog + "_dense", "--dump_mem_digest --memory dense", dump_mem=".digest")
+    assert dense["dump_mem"].read_text() == paged["dump_mem"].read_text()
+    assert "Memory backend" not in proc.stdout
+
+DMA_PATCH_PROGRAM = """
+MOV_I24 1
+MOV_R_I16 R2, 0
+JMP_L patched
+patched:
+MOV_R_I16 R1, 0x11
+CMP_R_R R2, ACC
+BRA_L done
+MOV_R_I16 R2, 1
+MOV_R_I16 R3, 12
+MOV_R_I16 R4, 0x1000
+MOV_R_I16 R5, 4
+P_DMA_SRC_R R4
+P_DMA_DST_R R3
+P_DMA_LEN_R R5
+P_DMA_CPY
+P_SCH_FNC
+JMP_L patched
+done:
+HLT
+"""
+
+@pytest.mark.parametrize("flags", ["", "--functional"])
+def test_dma_over_executed_code(assemble, run_vpu, flags):
+    #The block at patched runs once, its first instruction is replaced by a DMA copy, and it is
+    #entered again at the same address
+    patch = assemble("dma_patch_word", "MOV_R_I16 R1, 0x22\n")
+    bin = assemble("dma_patch", DMA_PATCH_PROGRAM, [(0x1000, patch.read_bytes()[:4])])
+
+    out, _ = run_vpu(bin, "dma_patch", flags, dump_regs=".reg")
+    regs = dict(line.split() for line in out["dump_regs"].read_text().splitlines())
+    assert int(regs["R2"]) == 1
+    assert int(regs["R1"]) == 0x22
+
+#The copy starts at loop and rewrites its first instruction, the loop counts in ACC until it
+#fetches the new one. Nothing waits for the copy before then.
+DMA_PATCH_LOOP_PROGRAM = """
+MOV_I24 0x100000
+MOV_R_R R4, ACC
+MOV_R_I16 R3, 0x2C
+MOV_I24 0x2000
+MOV_R_R R5, ACC
+MOV_R_I16 R6, 0x22
+MOV_I24 0
+P_DMA_SRC_R R4
+P_DMA_DST_R R3
+P_DMA_LEN_R R5
+P_DMA_CPY
+loop:
+MOV_R_I16 R1, {}
+ADD_I24 1
+CMP_R_R R1, R6
+BRA_L done
+JMP_L loop
+done:
+P_SCH_FNC
+HLT
+"""
+
+#A copy and, on another channel, a set of the bytes being copied, which soon overtakes it
+DMA_COPY_UNDER_SET_PROGRAM = """
+MOV_I24 0x100000
+MOV_R_R R1, ACC
+MOV_I24 0x300000
+MOV_R_R R2, ACC
+MOV_I24 0x8000
+MOV_R_R R3, ACC
+MOV_R_I16 R4, 0x5A
+P_DMA_SRC_R R1
+P_DMA_DST_R R2
+P_DMA_LEN_R R3
+P_DMA_CPY
+P_DMA_DST_R R1
+P_DMA_SET_R R4
+P_SCH_FNC
+HLT
+"""
+
+#A set into the framebuffer from a chain at 0x10000, then a clear of it
+DMA_UNDER_CLEAR_PROGRAM = """
+MOV_I24 0x10000
+MOV_R_R R1, ACC
+MOV_R_I16 R2, 0
+MOV_R_I16 R3, 0x1234
+P_DMA_SRC_R R1
+P_DMA_LEN_R R2
+P_DMA_CPY
+P_BLI_COL_R R3
+P_BLI_CLR
+P_SCH_FNC
+HLT
+"""
+
+#The core halts with the set still in progress
+DMA_HALT_MID_SET_PROGRAM = """
+MOV_I24 0x100000
+MOV_R_R R1, ACC
+MOV_I24 0x8000
+MOV_R_R R2, ACC
+MOV_R_I16 R3, 0x5A
+P_DMA_DST_R R1
+P_DMA_LEN_R R2
+P_DMA_SET_R R3
+HLT
+"""
+
+def patched_loop(assemble):
+    patch = assemble("dma_patch_loop_new", DMA_PATCH_LOOP_PROGRAM.format("0x22")).read_bytes()[0x2C:]
+    return DMA_PATCH_LOOP_PROGRAM.format("0x11"), [(0x100000, patch.ljust(0x2000, b"\0"))]
+
+DATA = bytes((i * 3 + 7) & 0xFF for i in range(0x8000))
+DMA_OVERLAP_CASES = [
+    ("dma_patch_loop", patched_loop, ""),
+    ("dma_copy_under_set", lambda _: (DMA_COPY_UNDER_SET_PROGRAM, [(0x100000, DATA)]), "--dma_channels 2"),
+    ("dma_under_clear", lambda _: (DMA_UNDER_CLEAR_PROGRAM, [(0x10000, dma_descriptor(0, FRAMEBUFFER_ADDR, 0x4000, 2, 0x5A, 0))]), ""),
+    ("dma_halt_mid_set", lambda _: (DMA_HALT_MID_SET_PROGRAM, []), ""),
+]
 
+@pytest.mark.parametrize("name, build, flags", DMA_OVERLAP_CASES, ids=[case[0] for case in DMA_OVERLAP_CASES])
+def test_dma_overlap_matches_trace(assemble, run_vpu, name, build, flags):
+    #Tracing moves every transfer line by line, a headless run moves it in one go unless the
+    #core, another channel, the blitter or the end of the run reaches it first
+    bin = assemble(name, *build(assemble))
+    headless, _ = run_vpu(bin, name + "_headless", flags, "--dump_mem_digest", dump_regs=".reg", dump_mem=".digest")
+    traced, _ = run_vpu(bin, name + "_traced", flags, "--dump_mem_digest --trace", dump_regs=".reg", dump_mem=".digest")
+    assert headless["dump_regs"].read_text() == traced["dump_regs"].read_text()
+    assert headless["dump_mem"].read_text() == traced["dump_mem"].read_text()
@@ -1,4 +1,6 @@
+import struct
 from dataclasses import dataclass
+from pathlib import Path
 @dataclass
 class RegState:
     PC: int
@@ -10,4 +12,51 @@ class RegState:
     R5: int
     R6: int
     R7: int
-    R8: int
\ No newline at end of file
+    R8: int
+
+SECTIONED_MAGIC = b"VPUS"
+SEGMENT_ZERO_FILL = 0x1
+
+def write_sectioned(path, segments):
+    """Write a sectioned program container.
+
+    segments is a list of (address, data) where data is either bytes to load
+    or an int length to zero fill.
+    """
+    header = SECTIONED_MAGIC + struct.pack("<I", len(segments))
+    offset = len(header) + 16 * len(segments)
+    table = b""
+    payload = b""
+    for address, data in segments:
+        if isinstance(data, int):
+            table += struct.pack("<IIII", address, data, 0, SEGMENT_ZERO_FILL)
+        else:
+            table += struct.pack("<IIII", address, len(data), offset + len(payload), 0)
+            payload += data
+    Path(path).write_bytes(header + table + payload)
+
+
+class RangeMemory:
+    """Memory dumped with --dump_mem_range, indexed by absolute address"""
+    def __init__(self, ranges, data):
+        self.ranges = []
+        offset = 0
+        for addr, length in ranges:
+            self.ranges.append((addr, length, offset))
+            offset += length
+        assert offset == len(data)
+        self.data = data
+
+    def __getitem__(self, addr):
+        for base, length, offset in self.ranges:
+            if base <= addr < base + length:
+                return self.data[offset + addr - base]
+        raise IndexError(f"Address {addr:#x} was not dumped")
+
+
+def fnv1a(data):
+    """64-bit FNV-1a, as written by --dump_mem_digest"""
+    h = 0xCBF29CE484222325
+    for b in data:
+        h = ((h ^ b) * 0x100000001B3) & 0xFFFFFFFFFFFFFFFF
+    return h